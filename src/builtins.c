@@ -1,9 +1,12 @@
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include "builtins.h"
 #include "io_helpers.h"
 #include "server.h"
+#include "commands.h"
 // ====== Command execution =====
 
 /* Return: index of builtin or -1 if cmd doesn't match a builtin
@@ -17,6 +20,14 @@ bn_ptr check_builtin(const char *cmd) {
     return BUILTINS_FN[cmd_num];
 }
 
+bn_ptr check_stage_builtin(const char *cmd) {
+    bn_ptr fn = check_builtin(cmd);
+    if (fn == bn_echo || fn == bn_ls || fn == bn_cat || fn == bn_wc) {
+        return fn;
+    }
+    return NULL;
+}
+
 
 // ===== Builtins =====
 
@@ -405,14 +416,30 @@ ssize_t bn_cd(char **tokens){
     return 0;
 }
 
+/* Copy everything readable on fd to the builtin's output.
+ * Return: 0 on success and -1 on error
+ */
+static ssize_t copy_fd(int fd){
+    char buffer[IO_CHUNK];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0){
+        if (n < 0){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (display_data(buffer, n) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
 ssize_t bn_cat(char **tokens){
     ssize_t index = 1;
     if (tokens[index] == NULL){
-        if (!isatty(STDIN_FILENO)){
-                char buffer[128];
-                while (fgets(buffer, sizeof(buffer), stdin)) {
-                    display_message(buffer);
-            }
+        if (!isatty(input_fd())){
+            // A reader that went away is no error of cat's
+            copy_fd(input_fd());
             return 0;
         }
         display_error("ERROR: No input source provided: ", "cat");
@@ -423,16 +450,13 @@ ssize_t bn_cat(char **tokens){
         return -1;
     }
     char *filename = tokens[index];
-    FILE *f = fopen(filename, "r");
-    char buffer[128];
-    if (f == NULL){
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
         display_error("ERROR: Cannot open file: ", filename);
         return -1;
     }
-    while (fgets(buffer, sizeof(buffer), f)){
-        display_message(buffer);
-    }
-    fclose(f);
+    copy_fd(fd);
+    close(fd);
     return 0;
 }
 
@@ -450,46 +474,44 @@ ssize_t bn_wc(char **tokens) {
         filename = tokens[1];  
     }
 
-    if (!std && filename == NULL) {
-        display_error("ERROR: No input source provided", "");
-        return -1;
-    }
-
-    FILE *f = std ? stdin : fopen(filename, "r");
-    if (f == NULL) {
+    int fd = std ? input_fd() : open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         display_error("ERROR: Cannot open file: ", filename);
         return -1;
     }
 
-    if (std && feof(f)) {
-        display_error("ERROR: No input source provided", "");
-        fclose(f);
-        return -1;
-    }
-
     int char_count = 0, line_count = 0, word_count = 0;
     int in_word = 0;
-    char c;
-    while ((c = fgetc(f)) != EOF) {
-        char_count++;
-        if (c == '\n') {
-            line_count++;
-            in_word = 0;
-        } else if (c == ' ' || c == '\t') {
-            in_word = 0;
-        } else if (!in_word) {
-            word_count++;
-            in_word = 1;
+    char buffer[IO_CHUNK];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        char_count += n;
+        for (ssize_t i = 0; i < n; i++) {
+            char c = buffer[i];
+            if (c == '\n') {
+                line_count++;
+                in_word = 0;
+            } else if (c == ' ' || c == '\t') {
+                in_word = 0;
+            } else if (!in_word) {
+                word_count++;
+                in_word = 1;
+            }
         }
     }
 
     
-    if (!std) fclose(f);
+    if (!std) close(fd);
 
     
-    printf("word count %d\n", word_count);
-    printf("character count %d\n", char_count);
-    printf("newline count %d\n", line_count);
+    char counts[128];
+    snprintf(counts, sizeof(counts), "word count %d\ncharacter count %d\nnewline count %d\n",
+             word_count, char_count, line_count);
+    display_message(counts);
 
     return 0;
 }
@@ -523,13 +545,15 @@ ssize_t bn_start_server(char **tokens){
         display_error("ERROR: ","No port provided");
         return -1;
     }
-    if (tokens[2] != NULL){
-        display_error("ERROR: ", "Too many arguments");
-        return -1;
-    }
     char *endptr;
     int port = strtol(tokens[1], &endptr, 10);
-    return start_server(port);
+
+    ServerOptions opts;
+    server_options_default(&opts);
+    if (parse_server_options(tokens + 2, &opts) < 0){
+        return -1;
+    }
+    return start_server(port, &opts);
 }
 
 ssize_t bn_close_server(char **tokens){
@@ -551,6 +575,14 @@ ssize_t bn_start_client(char **tokens){
         display_error("ERROR: ", "No port provided");
         return -1;
     }
+    // unix:/path names the server's socket instead of a port and hostname
+    if (strncmp(tokens[1], UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0){
+        if (tokens[2] != NULL){
+            display_error("ERROR: ", "Too many arguments");
+            return -1;
+        }
+        return start_client(0, tokens[1]);
+    }
     if (tokens[2] == NULL){
         display_error("ERROR: ", "No hostname provided");
         return -1;
@@ -567,4 +599,90 @@ ssize_t bn_start_client(char **tokens){
     }
     char *hostname = tokens[2];
     return start_client(port, hostname);
-}
\ No newline at end of file
+}
+/* Print the running server's counters straight from shared memory.
+ * Rates are over the interval since the previous server-stats call, or
+ * since the server started on the first call.
+ */
+ssize_t bn_server_stats(char **tokens){
+    static ServerStats prev;
+    static double prev_uptime = 0;
+
+    if (tokens[1] != NULL){
+        display_error("ERROR: ", "Too many arguments");
+        return -1;
+    }
+    ServerStats now;
+    double uptime;
+    int workers = server_stats(&now, &uptime);
+    if (workers < 0){
+        display_error("ERROR: ", "No server running");
+        return -1;
+    }
+    if (uptime < prev_uptime){
+        // A different server run; start the rates over
+        memset(&prev, 0, sizeof(prev));
+        prev_uptime = 0;
+    }
+    double interval = uptime - prev_uptime > 0 ? uptime - prev_uptime : 1;
+
+    char line[MAX_STR_LEN];
+    snprintf(line, sizeof(line), "workers %d, up %.1fs\n", workers, uptime);
+    display_message(line);
+    snprintf(line, sizeof(line), "clients %lu (accepted %lu, shed %lu)\n",
+             now.clients, now.accepted, now.shed);
+    display_message(line);
+    snprintf(line, sizeof(line), "msgs in %lu (%.1f/s), out %lu (%.1f/s)\n",
+             now.msgs_in, (now.msgs_in - prev.msgs_in) / interval,
+             now.msgs_out, (now.msgs_out - prev.msgs_out) / interval);
+    display_message(line);
+    snprintf(line, sizeof(line), "bytes in %lu (%.1f/s), out %lu (%.1f/s)\n",
+             now.bytes_in, (now.bytes_in - prev.bytes_in) / interval,
+             now.bytes_out, (now.bytes_out - prev.bytes_out) / interval);
+    display_message(line);
+    snprintf(line, sizeof(line), "queued %lu, write calls %lu\n", now.queued, now.write_calls);
+    display_message(line);
+    snprintf(line, sizeof(line), "dropped oldest %lu, newest %lu, slow disconnects %lu\n",
+             now.dropped_oldest, now.dropped_newest, now.slow_disconnects);
+    display_message(line);
+    snprintf(line, sizeof(line), "queue allocation failures %lu\n", now.queue_failures);
+    display_message(line);
+    snprintf(line, sizeof(line), "timeouts %lu\n", now.timeouts);
+    display_message(line);
+    snprintf(line, sizeof(line), "throttled delayed %lu, dropped %lu\n",
+             now.throttle_delays, now.throttle_drops);
+    display_message(line);
+    snprintf(line, sizeof(line), "bus out %lu, in %lu, lost %lu\n",
+             now.bus_out, now.bus_in, now.bus_lost);
+    display_message(line);
+
+    prev = now;
+    prev_uptime = uptime;
+    return 0;
+}
+
+/* hash lists the remembered command paths, hash -r forgets them, and
+ * hash <cmd...> looks each one up now.
+ */
+ssize_t bn_hash(char **tokens){
+    if (tokens[1] == NULL){
+        command_hash_list();
+        return 0;
+    }
+    if (strcmp(tokens[1], "-r") == 0){
+        if (tokens[2] != NULL){
+            display_error("ERROR: Too many arguments: ", "hash -r takes no commands");
+            return -1;
+        }
+        command_hash_reset();
+        return 0;
+    }
+    ssize_t result = 0;
+    for (int i = 1; tokens[i] != NULL; i++){
+        if (command_path(tokens[i]) == NULL){
+            display_error("ERROR: Unknown command: ", tokens[i]);
+            result = -1;
+        }
+    }
+    return result;
+}
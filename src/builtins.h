@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <stdio.h>
 
+#define IO_CHUNK (64 * 1024)    // bytes cat and wc read at a time
 
 
 /* Type for builtin handling functions
@@ -24,17 +25,25 @@ ssize_t bn_start_server(char **tokens);
 ssize_t bn_close_server(char **tokens);
 ssize_t bn_send(char **tokens);
 ssize_t bn_start_client(char **tokens);
+ssize_t bn_server_stats(char **tokens);
+ssize_t bn_hash(char **tokens);
 
 
 /* Return: index of builtin or -1 if cmd doesn't match a builtin
  */
 bn_ptr check_builtin(const char *cmd);
 
+/* Return: the builtin for cmd if it only reads input_fd() and writes
+ * through display_message, so a pipeline can run it on a thread of the
+ * shell instead of forking, or NULL
+ */
+bn_ptr check_stage_builtin(const char *cmd);
+
 
 /* BUILTINS and BUILTINS_FN are parallel arrays of length BUILTINS_COUNT
  */
-static const char * const BUILTINS[] = {"echo", "ls", "cd", "cat", "wc", "kill", "start-server", "close-server", "send", "start-client"};
-static const bn_ptr BUILTINS_FN[] = {bn_echo, bn_ls, bn_cd, bn_cat, bn_wc, bn_kill,bn_start_server, bn_close_server, bn_send, bn_start_client, NULL};    // Extra null element for 'non-builtin'
+static const char * const BUILTINS[] = {"echo", "ls", "cd", "cat", "wc", "kill", "start-server", "close-server", "send", "start-client", "server-stats", "hash"};
+static const bn_ptr BUILTINS_FN[] = {bn_echo, bn_ls, bn_cd, bn_cat, bn_wc, bn_kill,bn_start_server, bn_close_server, bn_send, bn_start_client, bn_server_stats, bn_hash, NULL};    // Extra null element for 'non-builtin'
 static const ssize_t BUILTINS_COUNT = sizeof(BUILTINS) / sizeof(char *);
 
 #endif
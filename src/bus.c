@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "bus.h"
+#include "io_helpers.h"
+
+#define BUS_MAGIC 0x6d7973682d627573ULL    // "mysh-bus"
+#define BUS_MASK ((uint64_t)BUS_SIZE - 1)
+#define BUS_ALIGN 16
+#define BUS_MAP_SIZE (sizeof(BusHeader) + BUS_SIZE)
+#define BUS_ATTACH_TRIES 1000               // 1 ms apart, while a creator sets up
+#define BUS_OPEN_TRIES 8                    // stale buses replaced before giving up
+
+
+// ===== Helpers =====
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void pause_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+static size_t record_size(uint32_t len) {
+    return (sizeof(BusRecord) + len + BUS_ALIGN - 1) & ~(size_t)(BUS_ALIGN - 1);
+}
+
+static BusRecord *record_at(MsgBus *bus, uint64_t pos) {
+    return (BusRecord *)(bus->ring + (pos & BUS_MASK));
+}
+
+/* Fill a record seqlock style: commit goes to 0 before the payload is
+ * touched and to pos + 1 once it is all there.
+ */
+static void write_record(MsgBus *bus, uint64_t pos, int32_t origin, const char *data, uint32_t len) {
+    BusRecord *rec = record_at(bus, pos);
+    __atomic_store_n(&rec->commit, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->len = len;
+    rec->origin = origin;
+    if (data) memcpy(rec->data, data, len);
+    __atomic_store_n(&rec->commit, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+// ===== Membership =====
+
+/* Members hold a shared flock on the object for as long as they are
+ * attached; the kernel drops it when the last process holding one dies,
+ * however it went. A bus nobody holds is stale and is replaced.
+ */
+
+/* Remove the bus behind fd if no member holds it.
+ * Return: 1 if it was stale and is gone, 0 if it is in use
+ */
+static int remove_if_stale(MsgBus *bus, int fd) {
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) return 0;
+    shm_unlink(bus->name);
+    return 1;
+}
+
+/* Return: whether the name still leads to the object open on fd, which
+ * a member that found it stale may have just removed
+ */
+static int still_named(MsgBus *bus, int fd) {
+    struct stat ours, named;
+    int named_fd = shm_open(bus->name, O_RDONLY | O_CLOEXEC, 0);
+    if (named_fd < 0) return 0;
+    int same = fstat(fd, &ours) == 0 && fstat(named_fd, &named) == 0 &&
+               ours.st_dev == named.st_dev && ours.st_ino == named.st_ino;
+    close(named_fd);
+    return same;
+}
+
+/* One attempt at attaching to or creating the bus.
+ * Return: 0 on success, 1 to try again after removing a stale bus or
+ * losing a race with one, and -1 on error
+ */
+static int attach(MsgBus *bus) {
+    int fd = shm_open(bus->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    int created = fd >= 0;
+    if (created) {
+        // Held before the magic is set, so joiners never think it stale
+        flock(fd, LOCK_SH);
+    } else if (errno == EEXIST) {
+        fd = shm_open(bus->name, O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0 && errno == ENOENT) return 1;
+    }
+    if (fd < 0) {
+        perror("shm_open");
+        return -1;
+    }
+
+    if (created && ftruncate(fd, BUS_MAP_SIZE) < 0) {
+        perror("ftruncate");
+        shm_unlink(bus->name);
+        close(fd);
+        return -1;
+    }
+    // A joiner can get here before the creator has sized the object
+    struct stat st;
+    for (int i = 0; !created && i < BUS_ATTACH_TRIES; i++) {
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= BUS_MAP_SIZE) break;
+        pause_ms(1);
+    }
+    if (!created && (fstat(fd, &st) < 0 || (size_t)st.st_size < BUS_MAP_SIZE)) {
+        // Its creator died before sizing it
+        int stale = remove_if_stale(bus, fd);
+        close(fd);
+        if (stale) return 1;
+        display_error("ERROR: Message bus is not ready: ", bus->name);
+        return -1;
+    }
+
+    void *map = mmap(NULL, BUS_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        if (created) shm_unlink(bus->name);
+        close(fd);
+        return -1;
+    }
+    bus->hdr = map;
+    bus->ring = (char *)map + sizeof(BusHeader);
+
+    if (created) {
+        // The object starts zeroed; the magic says the rest is valid
+        __atomic_store_n(&bus->hdr->magic, BUS_MAGIC, __ATOMIC_RELEASE);
+        bus->fd = fd;
+        return 0;
+    }
+
+    for (int i = 0; i < BUS_ATTACH_TRIES &&
+         __atomic_load_n(&bus->hdr->magic, __ATOMIC_ACQUIRE) != BUS_MAGIC; i++) {
+        pause_ms(1);
+    }
+    int ready = __atomic_load_n(&bus->hdr->magic, __ATOMIC_ACQUIRE) == BUS_MAGIC;
+    int stale = remove_if_stale(bus, fd);
+    int held = 0;
+    // A member finding it stale holds it exclusively while removing it
+    for (int i = 0; !stale && i < BUS_ATTACH_TRIES; i++) {
+        if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+            held = 1;
+            break;
+        }
+        pause_ms(1);
+    }
+    if (held && ready && still_named(bus, fd)) {
+        bus->fd = fd;
+        return 0;
+    }
+
+    munmap(map, BUS_MAP_SIZE);
+    close(fd);
+    if (stale || (held && ready)) return 1;
+    display_error(held ? "ERROR: Not a message bus: " : "ERROR: Message bus is busy: ", bus->name);
+    return -1;
+}
+
+MsgBus *bus_open(const char *name) {
+    MsgBus *bus = calloc(1, sizeof(MsgBus));
+    if (!bus) {
+        perror("calloc");
+        return NULL;
+    }
+    snprintf(bus->name, sizeof(bus->name), "/mysh-bus-%s", name);
+    bus->self = (int32_t)getpid();
+
+    int result = 1;
+    for (int i = 0; i < BUS_OPEN_TRIES && result == 1; i++) {
+        result = attach(bus);
+    }
+    if (result != 0) {
+        if (result == 1) display_error("ERROR: Message bus keeps changing: ", bus->name);
+        free(bus);
+        return NULL;
+    }
+    return bus;
+}
+
+void bus_close(MsgBus *bus) {
+    // Only the last member out gets the lock to itself
+    remove_if_stale(bus, bus->fd);
+    munmap(bus->hdr, BUS_MAP_SIZE);
+    close(bus->fd);
+    free(bus);
+}
+
+
+// ===== Publishing =====
+
+int bus_publish(MsgBus *bus, const char *data, size_t len) {
+    if (len > BUS_MAX_MSG) return -1;
+
+    size_t size = record_size(len);
+    uint64_t pos;
+    while (1) {
+        pos = __atomic_fetch_add(&bus->hdr->head, size, __ATOMIC_ACQ_REL);
+        size_t room = BUS_SIZE - (pos & BUS_MASK);
+        if (size <= room) break;
+        // Records never wrap; pad out both sides of the end and go again
+        write_record(bus, pos, 0, NULL, room - sizeof(BusRecord));
+        write_record(bus, pos + room, 0, NULL, size - room - sizeof(BusRecord));
+    }
+    write_record(bus, pos, bus->self, data, len);
+
+    // Only readers that went to sleep need the syscall
+    __atomic_add_fetch(&bus->hdr->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bus->hdr->waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &bus->hdr->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+
+// ===== Reading =====
+
+int bus_cursor_init(MsgBus *bus, BusCursor *cursor) {
+    cursor->pos = __atomic_load_n(&bus->hdr->head, __ATOMIC_ACQUIRE);
+    cursor->stalled_since = 0;
+    cursor->scratch = malloc(BUS_MAX_MSG);
+    if (!cursor->scratch) {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+void bus_cursor_free(BusCursor *cursor) {
+    free(cursor->scratch);
+    cursor->scratch = NULL;
+}
+
+/* Jump to the newest position after losing track of the records.
+ */
+static void skip_ahead(MsgBus *bus, BusCursor *cursor, unsigned long *lost) {
+    cursor->pos = __atomic_load_n(&bus->hdr->head, __ATOMIC_ACQUIRE);
+    cursor->stalled_since = 0;
+    (*lost)++;
+}
+
+size_t bus_read(MsgBus *bus, BusCursor *cursor, BusMsgFn fn, void *arg, unsigned long *lost) {
+    size_t count = 0;
+    while (1) {
+        uint64_t head = __atomic_load_n(&bus->hdr->head, __ATOMIC_ACQUIRE);
+        if (cursor->pos == head) break;
+        if (head - cursor->pos > BUS_SIZE) {
+            // Publishers have reserved the bytes under the cursor again
+            skip_ahead(bus, cursor, lost);
+            continue;
+        }
+
+        BusRecord *rec = record_at(bus, cursor->pos);
+        if (__atomic_load_n(&rec->commit, __ATOMIC_ACQUIRE) != cursor->pos + 1) {
+            // Still being written, or its publisher died halfway
+            uint64_t now = monotonic_ms();
+            if (cursor->stalled_since == 0) {
+                cursor->stalled_since = now;
+            } else if (now - cursor->stalled_since >= BUS_STALL_MS) {
+                skip_ahead(bus, cursor, lost);
+                continue;
+            }
+            break;
+        }
+        cursor->stalled_since = 0;
+
+        uint32_t len = rec->len;
+        int32_t origin = rec->origin;
+        int wanted = origin != 0 && origin != bus->self && len <= BUS_MAX_MSG;
+        if (wanted) memcpy(cursor->scratch, rec->data, len);
+
+        // If the copy raced with a publisher a lap ahead, it is torn
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&bus->hdr->head, __ATOMIC_RELAXED);
+        if (head - cursor->pos > BUS_SIZE) {
+            skip_ahead(bus, cursor, lost);
+            continue;
+        }
+
+        cursor->pos += record_size(len);
+        if (wanted) {
+            fn(arg, cursor->scratch, len);
+            count++;
+        }
+    }
+    return count;
+}
+
+uint32_t bus_seq(MsgBus *bus) {
+    return __atomic_load_n(&bus->hdr->seq, __ATOMIC_SEQ_CST);
+}
+
+void bus_wait(MsgBus *bus, BusCursor *cursor, uint32_t seen) {
+    struct timespec stall = {0, BUS_STALL_MS * 1000000L};
+    __atomic_add_fetch(&bus->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bus->hdr->seq, __ATOMIC_SEQ_CST) == seen) {
+        syscall(SYS_futex, &bus->hdr->seq, FUTEX_WAIT, seen,
+                cursor->stalled_since ? &stall : NULL, NULL, 0);
+    }
+    __atomic_sub_fetch(&bus->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,103 @@
+#ifndef __BUS_H__
+#define __BUS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+#define BUS_SIZE (16 * 1024 * 1024)     // ring bytes, a power of two
+#define BUS_MAX_MSG (BUS_SIZE / 8)      // largest payload a record can hold
+#define BUS_NAME_MAX 32
+#define BUS_STALL_MS 100                // how long an unfinished record may block readers
+
+/* The start of the shared mapping, followed by the ring. head only ever
+ * grows; a record at position p lives at p % BUS_SIZE.
+ */
+typedef struct BusHeader {
+    uint64_t magic;         // set last by the creator
+    uint64_t head;          // next position to reserve
+    uint32_t seq;           // bumped by every publish, the futex readers sleep on
+    uint32_t waiters;       // readers asleep on seq
+} __attribute__((aligned(64))) BusHeader;
+
+/* A record in the ring, 16 bytes aligned. commit is the record's
+ * position + 1 once its payload is complete, so readers can tell it from
+ * an older lap or a record still being written. origin 0 marks padding
+ * that skips to the end of the ring.
+ */
+typedef struct BusRecord {
+    uint64_t commit;
+    uint32_t len;
+    int32_t origin;         // publishing process, see MsgBus.self
+    char data[];
+} BusRecord;
+
+/* A named ring in shared memory that server processes on one host
+ * publish their broadcasts to. Publishers claim space with one atomic
+ * add and never wait for readers; each reader keeps its own cursor and
+ * finds out it was lapped instead of holding anyone up.
+ */
+typedef struct MsgBus {
+    char name[BUS_NAME_MAX + 16];   // shm object name
+    int fd;                 // holds this process's shared flock, inherited across fork
+    BusHeader *hdr;
+    char *ring;
+    int32_t self;           // origin of this process's records
+} MsgBus;
+
+/* One reader's position. A reader sees every record published after it
+ * started, except what it loses by falling a whole ring behind.
+ */
+typedef struct BusCursor {
+    uint64_t pos;
+    uint64_t stalled_since; // ms an unfinished record has blocked pos, 0 if none
+    char *scratch;          // BUS_MAX_MSG bytes, so payloads are copied out whole
+} BusCursor;
+
+/* Called by bus_read for each message from another member.
+ */
+typedef void (*BusMsgFn)(void *arg, const char *data, size_t len);
+
+
+/* Attach to the bus called name, creating it if this is the first
+ * member or if every member of the existing one has died. The mapping
+ * and the membership are inherited across fork.
+ * Return: the bus or NULL on error
+ */
+MsgBus *bus_open(const char *name);
+
+/* Leave the bus; the last member out removes it. A member that dies
+ * without leaving is let go by the kernel, and the next bus_open
+ * replaces the bus once none are left.
+ */
+void bus_close(MsgBus *bus);
+
+/* Publish one message to every other member.
+ * Return: 0 on success and -1 if it is too large
+ */
+int bus_publish(MsgBus *bus, const char *data, size_t len);
+
+/* Start a cursor at the current end of the bus.
+ * Return: 0 on success and -1 on error
+ */
+int bus_cursor_init(MsgBus *bus, BusCursor *cursor);
+void bus_cursor_free(BusCursor *cursor);
+
+/* Pass every complete record after the cursor that another member
+ * published to fn, and advance past them.
+ * Return: number of messages passed; *lost counts the times the reader
+ * had to skip ahead
+ */
+size_t bus_read(MsgBus *bus, BusCursor *cursor, BusMsgFn fn, void *arg, unsigned long *lost);
+
+/* Return: the publish count to pass to bus_wait, read before bus_read
+ */
+uint32_t bus_seq(MsgBus *bus);
+
+/* Sleep until something is published after seen was read, or briefly
+ * if the cursor is stalled on an unfinished record.
+ */
+void bus_wait(MsgBus *bus, BusCursor *cursor, uint32_t seen);
+
+#endif
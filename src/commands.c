@@ -1 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "commands.h"
+#include "io_helpers.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static CmdHash *buckets[HASH_BUCKETS];
+
+
+// ===== Lookup =====
+
+static size_t bucket_of(const char *cmd) {
+    unsigned long long h = FNV_OFFSET;
+    for (const char *c = cmd; *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= FNV_PRIME;
+    }
+    return h % HASH_BUCKETS;
+}
+
+static int is_executable(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+/* Walk PATH for cmd the way execvp does, an empty entry meaning the
+ * current directory.
+ * Return: a malloc'd path to cmd, or NULL if there is none
+ */
+static char *search_path(const char *cmd) {
+    const char *dirs = getenv("PATH");
+    if (dirs == NULL) dirs = "/usr/local/bin:/usr/bin:/bin";
+
+    char path[PATH_MAX];
+    while (1) {
+        const char *end = strchr(dirs, ':');
+        if (end == NULL) end = dirs + strlen(dirs);
+        int len = end > dirs ? snprintf(path, sizeof(path), "%.*s/%s", (int)(end - dirs), dirs, cmd)
+                             : snprintf(path, sizeof(path), "%s", cmd);
+        if (len > 0 && (size_t)len < sizeof(path) && is_executable(path)) {
+            return strdup(path);
+        }
+        if (*end == '\0') return NULL;
+        dirs = end + 1;
+    }
+}
+
+static CmdHash *find(const char *cmd, CmdHash ***link) {
+    CmdHash **at = &buckets[bucket_of(cmd)];
+    while (*at && strcmp((*at)->name, cmd) != 0) at = &(*at)->next;
+    if (link) *link = at;
+    return *at;
+}
+
+const char *command_path(const char *cmd) {
+    if (strchr(cmd, '/')) return cmd;
+
+    CmdHash **link;
+    CmdHash *entry = find(cmd, &link);
+    if (entry && (entry->path || time(NULL) - entry->looked_up < HASH_MISS_SECS)) {
+        entry->hits++;
+        return entry->path;
+    }
+
+    char *path = search_path(cmd);
+    // A hit through a relative PATH entry depends on the directory, so
+    // only absolute ones are remembered
+    if (path && path[0] != '/') {
+        static char relative[PATH_MAX];
+        snprintf(relative, sizeof(relative), "%s", path);
+        free(path);
+        return relative;
+    }
+    if (!entry) {
+        entry = calloc(1, sizeof(CmdHash));
+        if (entry) entry->name = strdup(cmd);
+        if (!entry || !entry->name) {
+            perror("calloc");
+            free(entry);
+            free(path);
+            return NULL;
+        }
+        *link = entry;
+    }
+    entry->path = path;
+    entry->looked_up = time(NULL);
+    entry->hits++;
+    return entry->path;
+}
+
+void command_hash_check(const char *cmd) {
+    CmdHash **link;
+    CmdHash *entry = find(cmd, &link);
+    if (!entry || !entry->path || is_executable(entry->path)) return;
+    *link = entry->next;
+    free(entry->name);
+    free(entry->path);
+    free(entry);
+}
+
+void command_hash_reset() {
+    for (size_t i = 0; i < HASH_BUCKETS; i++) {
+        while (buckets[i]) {
+            CmdHash *entry = buckets[i];
+            buckets[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+
+// ===== Display =====
+
+void command_hash_list() {
+    char line[PATH_MAX + 64];
+    int any = 0;
+    for (size_t i = 0; i < HASH_BUCKETS; i++) {
+        for (CmdHash *entry = buckets[i]; entry; entry = entry->next) {
+            if (!any) display_message("hits\tcommand\n");
+            any = 1;
+            if (entry->path) {
+                snprintf(line, sizeof(line), "%4lu\t%s\n", entry->hits, entry->path);
+            } else {
+                snprintf(line, sizeof(line), "%4lu\t%s (not found)\n", entry->hits, entry->name);
+            }
+            display_message(line);
+        }
+    }
+    if (!any) display_message("hash: hash table empty\n");
+}
@@ -0,0 +1,44 @@
+#ifndef __COMMANDS_H__
+#define __COMMANDS_H__
+
+#include <time.h>
+
+
+#define HASH_BUCKETS 64         // chains in the command hash
+#define HASH_MISS_SECS 2        // how long a failed lookup is trusted
+
+/* A command name and where PATH led for it, cached so the shell walks
+ * PATH once per command instead of once per run. A name PATH had
+ * nothing for is kept too, with a NULL path, so a typo fails without a
+ * fork; it is looked up again after HASH_MISS_SECS in case it appeared.
+ */
+typedef struct CmdHash {
+    char *name;
+    char *path;             // absolute, or NULL if not found
+    unsigned long hits;
+    time_t looked_up;
+    struct CmdHash *next;
+} CmdHash;
+
+
+/* Return: the file to execv for cmd, or NULL if PATH has none. A cmd
+ * containing '/' is returned as it is. PATH is the environment's, as
+ * for execvp. A hit through a relative PATH entry is not remembered and
+ * its string only lasts until the next call; any other stays valid
+ * until the next command_hash_reset.
+ */
+const char *command_path(const char *cmd);
+
+/* Drop cmd from the hash if the file it points at is gone.
+ */
+void command_hash_check(const char *cmd);
+
+/* Forget every lookup, as when PATH changes.
+ */
+void command_hash_reset();
+
+/* Display each remembered command with its hits, bash style.
+ */
+void command_hash_list();
+
+#endif
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "history.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define MIN_POSTINGS 64
+
+
+// ===== Terms =====
+
+static int term_char(unsigned char c) {
+    return c >= 0x80 || isalnum(c);
+}
+
+/* Hash the next term at or after *at and move *at past it.
+ * Return: 1 if a term was found, 0 at the end of text
+ */
+static int next_term(const char *text, size_t len, size_t *at, uint64_t *hash) {
+    while (*at < len && !term_char(text[*at])) (*at)++;
+    if (*at == len) return 0;
+
+    uint64_t h = FNV_OFFSET;
+    while (*at < len && term_char(text[*at])) {
+        h ^= (unsigned char)tolower((unsigned char)text[*at]);
+        h *= FNV_PRIME;
+        (*at)++;
+    }
+    *hash = h ? h : 1;
+    return 1;
+}
+
+/* Return: the distinct terms of text, at most max of them, in hashes
+ */
+static size_t collect_terms(const char *text, size_t len, uint64_t *hashes, size_t max) {
+    size_t count = 0, at = 0;
+    uint64_t hash;
+    while (count < max && next_term(text, len, &at, &hash)) {
+        size_t i = 0;
+        while (i < count && hashes[i] != hash) i++;
+        if (i == count) hashes[count++] = hash;
+    }
+    return count;
+}
+
+
+// ===== Index =====
+
+static uint64_t term_bits(uint64_t hash) {
+    return (1ULL << (hash & 63)) | (1ULL << ((hash >> 6) & 63));
+}
+
+/* Return: whether posting n is still in the ring and about a message
+ * that is still kept
+ */
+static int posting_live(History *h, uint64_t n) {
+    return n != 0 && n + h->posting_cap >= h->next_posting &&
+           h->postings[n % h->posting_cap].msg >= h->first;
+}
+
+/* Move the live terms to a fresh table, dropping the rest.
+ * Return: 0 on success and -1 on error
+ */
+static int sweep_terms(History *h) {
+    TermSlot *fresh = calloc(h->term_cap, sizeof(TermSlot));
+    if (!fresh) {
+        perror("calloc");
+        return -1;
+    }
+    size_t mask = h->term_cap - 1, len = 0;
+    for (size_t i = 0; i < h->term_cap; i++) {
+        TermSlot *old = &h->terms[i];
+        if (old->hash == 0 || !posting_live(h, old->head)) continue;
+        size_t j = old->hash & mask;
+        while (fresh[j].hash != 0) j = (j + 1) & mask;
+        fresh[j] = *old;
+        len++;
+    }
+    free(h->terms);
+    h->terms = fresh;
+    h->term_len = len;
+    h->swept_at = h->next_posting;
+    return 0;
+}
+
+/* Return: the slot for hash, claimed if it had none, or NULL if the
+ * table is full
+ */
+static TermSlot *term_slot(History *h, uint64_t hash) {
+    size_t mask = h->term_cap - 1;
+    size_t i = hash & mask;
+    while (h->terms[i].hash != 0) {
+        if (h->terms[i].hash == hash) return &h->terms[i];
+        i = (i + 1) & mask;
+    }
+
+    if (h->term_len + 1 > h->term_cap / 4 * 3) {
+        // A sweep costs the whole table, so it has to be paid for by
+        // enough postings since the last one
+        if (h->next_posting - h->swept_at < h->term_cap / 4 || sweep_terms(h) < 0 ||
+            h->term_len + 1 > h->term_cap / 4 * 3) {
+            return NULL;
+        }
+        i = hash & mask;
+        while (h->terms[i].hash != 0) i = (i + 1) & mask;
+    }
+    h->terms[i].hash = hash;
+    h->terms[i].head = 0;
+    h->terms[i].count = 0;
+    h->term_len++;
+    return &h->terms[i];
+}
+
+/* Return: 0 on success and -1 if the term did not fit
+ */
+static int add_posting(History *h, uint64_t hash, uint64_t msg) {
+    TermSlot *slot = term_slot(h, hash);
+    if (!slot) return -1;
+    // Taking the number first retires whatever the new posting overwrites
+    uint64_t n = h->next_posting++;
+    Posting *posting = &h->postings[n % h->posting_cap];
+    posting->msg = msg;
+    posting->hash = hash;
+    posting->prev = posting_live(h, slot->head) ? slot->head : 0;
+    slot->count = posting->prev ? slot->count + 1 : 1;
+    slot->head = n;
+    return 0;
+}
+
+/* Return: whether message msg, which is still kept, has the term hash
+ * among postings that are still there
+ */
+static int has_term(History *h, uint64_t msg, uint64_t hash) {
+    HistEntry *entry = &h->entries[msg % h->entry_cap];
+    if ((entry->sig & term_bits(hash)) != term_bits(hash)) return 0;
+    if (entry->postings + h->posting_cap < h->next_posting) return 0;
+    for (uint32_t i = 0; i < entry->terms; i++) {
+        if (h->postings[(entry->postings + i) % h->posting_cap].hash == hash) return 1;
+    }
+    return 0;
+}
+
+
+// ===== History =====
+
+static size_t round_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+History *history_new(size_t text_bytes, size_t index_bytes) {
+    History *h = calloc(1, sizeof(History));
+    if (!h) {
+        perror("calloc");
+        return NULL;
+    }
+    h->text_cap = text_bytes;
+    h->entry_cap = text_bytes / HISTORY_AVG_MSG + 1;
+    // Each posting takes itself and half a term slot
+    h->posting_cap = index_bytes / (sizeof(Posting) + sizeof(TermSlot) / 2);
+    if (h->posting_cap < MIN_POSTINGS) h->posting_cap = MIN_POSTINGS;
+    h->term_cap = round_pow2(h->posting_cap / 2);
+    h->first = h->next = 1;
+    h->next_posting = 1;
+
+    // Pages are only touched as the rings fill up
+    h->text = malloc(h->text_cap);
+    h->entries = calloc(h->entry_cap, sizeof(HistEntry));
+    h->postings = calloc(h->posting_cap, sizeof(Posting));
+    h->terms = calloc(h->term_cap, sizeof(TermSlot));
+    if (!h->text || !h->entries || !h->postings || !h->terms) {
+        perror("calloc");
+        history_free(h);
+        return NULL;
+    }
+    pthread_mutex_init(&h->lock, NULL);
+    return h;
+}
+
+void history_free(History *h) {
+    free(h->text);
+    free(h->entries);
+    free(h->postings);
+    free(h->terms);
+    free(h);
+}
+
+void history_append(History *h, uint64_t seq, const char *data, size_t len) {
+    if (len == 0 || len > h->text_cap) return;
+
+    uint64_t hashes[HISTORY_MSG_TERMS];
+    size_t count = collect_terms(data, len, hashes, HISTORY_MSG_TERMS);
+
+    pthread_mutex_lock(&h->lock);
+    if (seq < h->next) {
+        pthread_mutex_unlock(&h->lock);
+        return;
+    }
+    // Messages never wrap around the end of the ring
+    uint64_t pos = h->text_end;
+    size_t offset = pos % h->text_cap;
+    if (offset + len > h->text_cap) pos += h->text_cap - offset;
+
+    // Make room for the text and give seq an entry of its own
+    if (seq - h->first >= h->entry_cap) h->first = seq + 1 - h->entry_cap;
+    while (h->first < h->next) {
+        HistEntry *oldest = &h->entries[h->first % h->entry_cap];
+        if (oldest->seq == h->first && pos + len - oldest->pos <= h->text_cap) break;
+        h->first++;
+    }
+    if (h->first >= h->next) h->first = seq;
+
+    memcpy(h->text + pos % h->text_cap, data, len);
+    h->text_end = pos + len;
+    h->next = seq + 1;
+    HistEntry *entry = &h->entries[seq % h->entry_cap];
+    entry->seq = seq;
+    entry->pos = pos;
+    entry->len = (uint32_t)len;
+    entry->time = time(NULL);
+    entry->postings = h->next_posting;
+    entry->terms = 0;
+    entry->sig = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        // A term that does not fit takes no number, so the run stays whole
+        if (add_posting(h, hashes[i], seq) < 0) continue;
+        entry->terms++;
+        entry->sig |= term_bits(hashes[i]);
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+int history_search(History *h, const char *query, size_t len, HistMatchFn fn, void *arg) {
+    uint64_t hashes[HISTORY_QUERY_TERMS];
+    size_t count = collect_terms(query, len, hashes, HISTORY_QUERY_TERMS);
+    if (count == 0) return -1;
+
+    uint64_t found[HISTORY_RESULTS];
+    size_t matches = 0;
+
+    pthread_mutex_lock(&h->lock);
+    // The rarest term has the shortest chain; a term with none matches nothing
+    size_t mask = h->term_cap - 1;
+    TermSlot *rarest = NULL;
+    for (size_t t = 0; t < count; t++) {
+        size_t i = hashes[t] & mask;
+        while (h->terms[i].hash != 0 && h->terms[i].hash != hashes[t]) i = (i + 1) & mask;
+        TermSlot *slot = &h->terms[i];
+        if (slot->hash == 0 || !posting_live(h, slot->head)) {
+            rarest = NULL;
+            break;
+        }
+        if (!rarest || slot->count < rarest->count) rarest = slot;
+    }
+
+    // Chains run newest first, and stop where the rings have moved on
+    uint64_t n = rarest ? rarest->head : 0;
+    while (matches < HISTORY_RESULTS && posting_live(h, n)) {
+        Posting *posting = &h->postings[n % h->posting_cap];
+        size_t t = 0;
+        while (t < count && (hashes[t] == rarest->hash || has_term(h, posting->msg, hashes[t]))) t++;
+        if (t == count) found[matches++] = posting->msg;
+        n = posting->prev;
+    }
+
+    for (size_t i = matches; i > 0; i--) {
+        HistEntry *entry = &h->entries[found[i - 1] % h->entry_cap];
+        fn(arg, entry->time, h->text + entry->pos % h->text_cap, entry->len);
+    }
+    pthread_mutex_unlock(&h->lock);
+    return (int)matches;
+}
+
+void history_bounds(History *h, uint64_t *first, uint64_t *next) {
+    pthread_mutex_lock(&h->lock);
+    *first = h->first;
+    *next = h->next;
+    pthread_mutex_unlock(&h->lock);
+}
+
+uint64_t history_read(History *h, uint64_t from, uint64_t to, HistReadFn fn, void *arg) {
+    uint64_t count = 0;
+    pthread_mutex_lock(&h->lock);
+    if (from < h->first) from = h->first;
+    if (to > h->next) to = h->next;
+    for (uint64_t seq = from; seq < to; seq++) {
+        HistEntry *entry = &h->entries[seq % h->entry_cap];
+        if (entry->seq != seq) continue;
+        fn(arg, seq, h->text + entry->pos % h->text_cap, entry->len);
+        count++;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return count;
+}
@@ -0,0 +1,112 @@
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+#define HISTORY_AVG_MSG 64      // message bytes per entry slot the ring sizes for
+#define HISTORY_RESULTS 20      // most matches one search returns
+#define HISTORY_QUERY_TERMS 8   // terms a search uses, the rest are ignored
+#define HISTORY_MSG_TERMS 64    // distinct terms indexed per message
+
+/* A message kept in the ring. The message with sequence number n lives at
+ * entries[n % entry_cap], if seq says it is that one; numbers the stream
+ * skipped leave older entries behind. Its postings are numbered
+ * postings .. postings + terms - 1.
+ */
+typedef struct HistEntry {
+    uint64_t seq;
+    uint64_t pos;           // absolute offset of its bytes, stored at pos % text_cap
+    uint64_t postings;
+    uint64_t sig;           // two bits per term, rules most candidates out cheaply
+    uint32_t len;
+    uint32_t terms;
+    time_t time;            // wall clock when it was appended
+} HistEntry;
+
+/* One occurrence of a term. Posting number n lives at
+ * postings[n % posting_cap]; prev chains to the term's next older one.
+ */
+typedef struct Posting {
+    uint64_t msg;
+    uint64_t prev;          // 0 if none
+    uint64_t hash;          // the term, so a message's own postings say what it contains
+} Posting;
+
+/* A term's 64-bit hash and its newest posting.
+ */
+typedef struct TermSlot {
+    uint64_t hash;          // 0 for a free slot
+    uint64_t head;
+    uint64_t count;         // postings since it was last absent, for picking the rarest term
+} TermSlot;
+
+/* The most recent broadcasts with an inverted index over their terms,
+ * shared by every shard. Everything is a ring of fixed size: messages
+ * fall out of the text ring oldest first, and postings out of theirs,
+ * so old postings simply end each term's chain and memory never grows.
+ * The term table only keeps terms whose newest posting is still there,
+ * and is swept of the rest when it fills; new terms that still do not
+ * fit go unindexed until the next sweep. A search walks the chain of
+ * its rarest term and checks each candidate's own postings for the rest.
+ */
+typedef struct History {
+    pthread_mutex_t lock;
+    char *text;
+    size_t text_cap;
+    uint64_t text_end;
+    HistEntry *entries;
+    size_t entry_cap;
+    uint64_t first;         // oldest sequence number that may be kept
+    uint64_t next;          // one past the newest
+    Posting *postings;
+    size_t posting_cap;
+    uint64_t next_posting;  // numbers start at 1
+    TermSlot *terms;
+    size_t term_cap;        // power of two, about half of posting_cap
+    size_t term_len;        // slots in use, live or not
+    uint64_t swept_at;      // next_posting at the last sweep
+} History;
+
+/* Called by history_search for each match, oldest first.
+ */
+typedef void (*HistMatchFn)(void *arg, time_t when, const char *data, size_t len);
+
+/* Called by history_read for each message in order.
+ */
+typedef void (*HistReadFn)(void *arg, uint64_t seq, const char *data, size_t len);
+
+
+/* Return: a history keeping up to text_bytes of messages (and
+ * text_bytes / HISTORY_AVG_MSG of them) with an index in about
+ * index_bytes, or NULL on error
+ */
+History *history_new(size_t text_bytes, size_t index_bytes);
+void history_free(History *history);
+
+/* Keep message seq and index its terms: runs of letters, digits and
+ * non-ASCII bytes, compared without case. Sequence numbers start at 1
+ * and only grow; an older one is ignored.
+ */
+void history_append(History *history, uint64_t seq, const char *data, size_t len);
+
+/* Return: the sequence numbers the history may hold, [*first, *next)
+ */
+void history_bounds(History *history, uint64_t *first, uint64_t *next);
+
+/* Pass every kept message from from up to to to fn, oldest first,
+ * while the history is locked.
+ * Return: number of messages passed
+ */
+uint64_t history_read(History *history, uint64_t from, uint64_t to, HistReadFn fn, void *arg);
+
+/* Find the newest messages, at most HISTORY_RESULTS, that contain every
+ * term of query, and pass them to fn while the history is locked.
+ * Return: number of matches, or -1 if query has no terms
+ */
+int history_search(History *history, const char *query, size_t len, HistMatchFn fn, void *arg);
+
+#endif
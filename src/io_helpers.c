@@ -2,16 +2,45 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
 
 #include "io_helpers.h"
 #define MAX_TOKENS 128
 
+// Where this thread's builtin reads and writes; a pipeline stage on its
+// own thread has pipe ends here instead
+static __thread int in_fd = STDIN_FILENO;
+static __thread int out_fd = STDOUT_FILENO;
+
+
 // ===== Output helpers =====
 
+void set_io_fds(int input, int output) {
+    in_fd = input;
+    out_fd = output;
+}
+
+int input_fd() {
+    return in_fd;
+}
+
 /* Prereq: str is a NULL terminated string
  */
 void display_message(char *str) {
-    write(STDOUT_FILENO, str, strnlen(str, MAX_STR_LEN));
+    write(out_fd, str, strnlen(str, MAX_STR_LEN));
+}
+
+int display_data(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(out_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
 }
 
 
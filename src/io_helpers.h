@@ -13,6 +13,18 @@
 void display_message(char *str);
 void display_error(char *pre_str, char *str);
 
+/* Write all of data where display_message writes.
+ * Return: 0 on success and -1 on error, such as a reader that went away
+ */
+int display_data(const char *data, size_t len);
+
+/* Point this thread's builtin input (input_fd) and display_message at
+ * other fds, as a pipeline stage on a thread of its own does. Every
+ * thread starts on STDIN_FILENO and STDOUT_FILENO.
+ */
+void set_io_fds(int input, int output);
+int input_fd();
+
 
 /* Prereq: in_ptr points to a character buffer of size > MAX_STR_LEN
  * Return: number of bytes read
@@ -0,0 +1,712 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "io_helpers.h"
+#include "server.h"
+
+#define MAX_EVENTS 256
+#define MAX_MSG_SIZE (60 * 1024)
+#define MAX_PENDING (256 * 1024)
+#define READ_CHUNK (64 * 1024)
+#define SYNC_TIMEOUT_NS (5ULL * 1000000000ULL)
+#define DRAIN_TIMEOUT_NS (2ULL * 1000000000ULL)
+#define ADMIT_TIMEOUT_NS (30ULL * 1000000000ULL)
+
+// Log-linear latency histogram: 32 sub-buckets per power of two (~3%)
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (48 * HIST_SUB)
+
+#define MSG_TAG "LG "
+#define ADMIT_PROBE "\\connected\r\n"
+#define ADMIT_REPLY " clients connected"
+#define SYNC_SEQ UINT64_MAX
+
+/* Load generator for the chat server. Opens N connections, has the
+ * first K of them send timestamped lines at a fixed total rate, and
+ * measures when each broadcast copy arrives back on every connection.
+ *
+ * All connections are opened at once, like clients reconnecting after a
+ * restart, and each asks for \connected as soon as it is up; the reply
+ * proves the server admitted it. --duration 0 stops after reporting
+ * how long that took.
+ *
+ * With --rooms R, connection i joins room r<i % R> first, so each
+ * message only fans out to the members of its sender's room.
+ *
+ * A unix:/path target in place of the port connects every connection to
+ * the server's Unix socket instead, and --host is ignored.
+ *
+ * Usage: loadgen <port|unix:PATH> [--host H] [--conns N] [--senders K] [--rooms R]
+ *                [--rate MSGS_PER_SEC] [--size BYTES] [--duration SECS]
+ */
+
+typedef struct Options {
+    int port;
+    const char *host;
+    const char *unix_path;  // connect here instead when set
+    int conns;
+    int senders;
+    int rooms;          // 0 = everyone in the lobby
+    long rate;          // total messages/sec across senders, 0 = unpaced
+    size_t size;        // bytes per message including "\r\n"
+    double duration;
+} Options;
+
+typedef struct Conn {
+    int fd;
+    int want_write;
+    char *out;          // encoded messages not yet accepted by the socket
+    size_t out_len;
+    size_t out_cap;
+    char *in;           // partial line carried over between reads
+    size_t in_len;
+    size_t in_cap;
+    uint64_t opened;    // when connect was called
+    int admitted;
+    int synced;
+    int joined;
+} Conn;
+
+typedef struct Histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static Options opts;
+static Conn *conns = NULL;
+static int epoll_fd = -1;
+static Histogram latency;
+static Histogram admit_latency;
+static uint64_t delivered = 0;
+static uint64_t delivered_bytes = 0;
+static uint64_t sent = 0;
+static uint64_t expected = 0;
+static int admitted_conns = 0;
+static int synced_conns = 0;
+static int joined_conns = 0;
+
+
+// ===== Helpers =====
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void usage() {
+    display_error("Usage: ", "loadgen <port|unix:PATH> [--host H] [--conns N] [--senders K] [--rooms R]");
+    display_error("       ", "[--rate MSGS_PER_SEC] [--size BYTES] [--duration SECS]");
+}
+
+/* Return: 0 and the parsed value on success, -1 if str is not a number
+ * in [min, max]
+ */
+static int parse_long(const char *str, long min, long max, long *out) {
+    char *end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (errno != 0 || *str == '\0' || *end != '\0' || value < min || value > max) {
+        return -1;
+    }
+    *out = value;
+    return 0;
+}
+
+static int parse_options(int argc, char *argv[]) {
+    opts.host = "127.0.0.1";
+    opts.conns = 50;
+    opts.senders = 1;
+    opts.rate = 1000;
+    opts.size = 64;
+    opts.duration = 5.0;
+
+    if (argc < 2) return -1;
+    long value;
+    if (strncmp(argv[1], UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+        opts.unix_path = argv[1] + strlen(UNIX_PREFIX);
+        if (strlen(opts.unix_path) >= UNIX_PATH_LEN) {
+            display_error("ERROR: Socket path too long: ", argv[1]);
+            return -1;
+        }
+    } else if (parse_long(argv[1], 1, 65535, &value) == -1) {
+        display_error("ERROR: Invalid port number: ", argv[1]);
+        return -1;
+    } else {
+        opts.port = (int)value;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 >= argc) {
+            display_error("ERROR: Missing value for ", argv[i]);
+            return -1;
+        }
+        const char *flag = argv[i];
+        const char *arg = argv[++i];
+        if (strcmp(flag, "--host") == 0) {
+            opts.host = arg;
+        } else if (strcmp(flag, "--conns") == 0) {
+            if (parse_long(arg, 1, 100000, &value) == -1) {
+                display_error("ERROR: Invalid connection count: ", (char *)arg);
+                return -1;
+            }
+            opts.conns = (int)value;
+        } else if (strcmp(flag, "--senders") == 0) {
+            if (parse_long(arg, 1, 100000, &value) == -1) {
+                display_error("ERROR: Invalid sender count: ", (char *)arg);
+                return -1;
+            }
+            opts.senders = (int)value;
+        } else if (strcmp(flag, "--rooms") == 0) {
+            if (parse_long(arg, 0, 100000, &value) == -1) {
+                display_error("ERROR: Invalid room count: ", (char *)arg);
+                return -1;
+            }
+            opts.rooms = (int)value;
+        } else if (strcmp(flag, "--rate") == 0) {
+            if (parse_long(arg, 0, 100000000, &value) == -1) {
+                display_error("ERROR: Invalid rate: ", (char *)arg);
+                return -1;
+            }
+            opts.rate = value;
+        } else if (strcmp(flag, "--size") == 0) {
+            if (parse_long(arg, 1, MAX_MSG_SIZE, &value) == -1) {
+                display_error("ERROR: Invalid message size: ", (char *)arg);
+                return -1;
+            }
+            opts.size = (size_t)value;
+        } else if (strcmp(flag, "--duration") == 0) {
+            char *end;
+            opts.duration = strtod(arg, &end);
+            if (*end != '\0' || opts.duration < 0) {
+                display_error("ERROR: Invalid duration: ", (char *)arg);
+                return -1;
+            }
+        } else {
+            display_error("ERROR: Unknown option: ", (char *)flag);
+            return -1;
+        }
+    }
+
+    if (opts.senders > opts.conns) opts.senders = opts.conns;
+    if (opts.rooms > opts.conns) opts.rooms = opts.conns;
+    return 0;
+}
+
+
+// ===== Histogram =====
+
+static int hist_index(uint64_t value) {
+    int shift = 0;
+    if (value >= 2 * HIST_SUB) {
+        shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    }
+    int index = shift * HIST_SUB + (int)(value >> shift);
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+/* Return: the largest value that falls into bucket index
+ */
+static uint64_t hist_upper(int index) {
+    if (index < 2 * HIST_SUB) return (uint64_t)index;
+    int shift = index / HIST_SUB - 1;
+    uint64_t mantissa = (uint64_t)(index - shift * HIST_SUB);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static void hist_record(Histogram *hist, uint64_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    if (value > hist->max) hist->max = value;
+}
+
+static uint64_t hist_percentile(const Histogram *hist, double pct) {
+    if (hist->total == 0) return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)hist->total);
+    if (rank >= hist->total) rank = hist->total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > rank) {
+            uint64_t upper = hist_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+
+// ===== Connections =====
+
+/* Start a non-blocking connect; it completes when the socket turns
+ * writable. A Unix socket connect either completes at once or fails
+ * with EAGAIN while the listen queue is full, so that one blocks.
+ */
+static int connect_one(const struct sockaddr_storage *addr, socklen_t addr_len) {
+    int is_unix = addr->ss_family == AF_UNIX;
+    int fd = socket(addr->ss_family, SOCK_STREAM | (is_unix ? 0 : SOCK_NONBLOCK), 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *)addr, addr_len) < 0 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    if (is_unix) fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/* Make room for need more bytes of output.
+ * Return: 0 on success and -1 on error
+ */
+static int reserve_out(Conn *conn, size_t need) {
+    if (conn->out_len + need <= conn->out_cap) return 0;
+    size_t cap = conn->out_cap ? conn->out_cap * 2 : 4096;
+    while (cap < conn->out_len + need) cap *= 2;
+    char *out = realloc(conn->out, cap);
+    if (!out) {
+        perror("realloc");
+        return -1;
+    }
+    conn->out = out;
+    conn->out_cap = cap;
+    return 0;
+}
+
+static int open_conns() {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    memset(&addr, 0, sizeof(addr));
+    if (opts.unix_path) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, opts.unix_path);
+        addr_len = sizeof(*un);
+    } else {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(opts.host, NULL, &hints, &res) != 0) {
+            display_error("ERROR: Unknown host: ", (char *)opts.host);
+            return -1;
+        }
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        *in = *(struct sockaddr_in *)res->ai_addr;
+        in->sin_port = htons(opts.port);
+        addr_len = sizeof(*in);
+        freeaddrinfo(res);
+    }
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    conns = calloc(opts.conns, sizeof(Conn));
+    if (!conns) {
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < opts.conns; i++) conns[i].fd = -1;
+    for (int i = 0; i < opts.conns; i++) {
+        conns[i].opened = now_ns();
+        conns[i].fd = connect_one(&addr, addr_len);
+        if (conns[i].fd < 0) return -1;
+
+        // The probe goes out once the connect completes
+        if (reserve_out(&conns[i], strlen(ADMIT_PROBE)) == -1) return -1;
+        memcpy(conns[i].out, ADMIT_PROBE, strlen(ADMIT_PROBE));
+        conns[i].out_len = strlen(ADMIT_PROBE);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.ptr = &conns[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        conns[i].want_write = 1;
+    }
+    return 0;
+}
+
+static void close_conns() {
+    if (conns) {
+        for (int i = 0; i < opts.conns; i++) {
+            if (conns[i].fd >= 0) close(conns[i].fd);
+            free(conns[i].out);
+            free(conns[i].in);
+        }
+        free(conns);
+    }
+    if (epoll_fd >= 0) close(epoll_fd);
+}
+
+static void set_want_write(Conn *conn, int want) {
+    if (conn->want_write == want) return;
+    struct epoll_event ev;
+    ev.events = want ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return;
+    }
+    conn->want_write = want;
+}
+
+/* Write as much pending output as the socket takes.
+ * Return: 0 on success and -1 if the connection failed
+ */
+static int flush_conn(Conn *conn) {
+    size_t done = 0;
+    while (done < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + done, conn->out_len - done, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            perror("send");
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    memmove(conn->out, conn->out + done, conn->out_len - done);
+    conn->out_len -= done;
+    set_want_write(conn, conn->out_len > 0);
+    return 0;
+}
+
+/* Append one "LG <seq> <timestamp> xxx...\r\n" line of opts.size bytes.
+ * Return: 0 on success, 1 if the connection is backed up, -1 on error
+ */
+static int queue_msg(Conn *conn, uint64_t seq) {
+    if (conn->out_len + opts.size > MAX_PENDING) return 1;
+    if (reserve_out(conn, opts.size) == -1) return -1;
+
+    char *line = conn->out + conn->out_len;
+    int len = snprintf(line, conn->out_cap - conn->out_len, MSG_TAG "%llu %llu ",
+                       (unsigned long long)seq, (unsigned long long)now_ns());
+    size_t used = (size_t)len;
+    if (used + 2 < opts.size) {
+        memset(line + used, 'x', opts.size - 2 - used);
+        used = opts.size - 2;
+    }
+    memcpy(line + used, "\r\n", 2);
+    conn->out_len += used + 2;
+    return 0;
+}
+
+/* Account for one broadcast line received by conn.
+ */
+static void handle_line(Conn *conn, const char *line, size_t len, uint64_t now) {
+    if (!conn->admitted && memmem(line, len, ADMIT_REPLY, strlen(ADMIT_REPLY))) {
+        conn->admitted = 1;
+        admitted_conns++;
+        hist_record(&admit_latency, now - conn->opened);
+        return;
+    }
+    if (len > 7 && memcmp(line, "Joined ", 7) == 0) {
+        if (!conn->joined) {
+            conn->joined = 1;
+            joined_conns++;
+        }
+        return;
+    }
+
+    const char *tag = memmem(line, len, MSG_TAG, strlen(MSG_TAG));
+    if (!tag) return;
+
+    char *end;
+    unsigned long long seq = strtoull(tag + strlen(MSG_TAG), &end, 10);
+    unsigned long long stamp = strtoull(end, NULL, 10);
+    if (seq == SYNC_SEQ) {
+        if (!conn->synced) {
+            conn->synced = 1;
+            synced_conns++;
+        }
+        return;
+    }
+
+    delivered++;
+    delivered_bytes += len + 2;
+    hist_record(&latency, now > stamp ? now - stamp : 0);
+}
+
+/* Read everything available and split it into lines.
+ * Return: 0 on success and -1 if the server closed the connection
+ */
+static int read_conn(Conn *conn) {
+    while (1) {
+        if (conn->in_cap - conn->in_len < READ_CHUNK) {
+            size_t cap = conn->in_cap ? conn->in_cap * 2 : 2 * READ_CHUNK;
+            char *in = realloc(conn->in, cap);
+            if (!in) {
+                perror("realloc");
+                return -1;
+            }
+            conn->in = in;
+            conn->in_cap = cap;
+        }
+
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("recv");
+            return -1;
+        }
+        if (n == 0) {
+            display_error("ERROR: ", "Server closed a connection");
+            return -1;
+        }
+
+        uint64_t now = now_ns();
+        size_t start = 0;
+        size_t end = conn->in_len + (size_t)n;
+        for (size_t i = conn->in_len; i < end; i++) {
+            if (conn->in[i] != '\n') continue;
+            size_t line_len = i - start;
+            if (line_len > 0 && conn->in[i - 1] == '\r') line_len--;
+            handle_line(conn, conn->in + start, line_len, now);
+            start = i + 1;
+        }
+        memmove(conn->in, conn->in + start, end - start);
+        conn->in_len = end - start;
+    }
+}
+
+/* Wait up to timeout_ms for socket events and service them.
+ * Return: 0 on success and -1 if a connection failed
+ */
+static int poll_conns(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        Conn *conn = events[i].data.ptr;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            if (read_conn(conn) == -1) return -1;
+        }
+        if (events[i].events & EPOLLOUT) {
+            if (flush_conn(conn) == -1) return -1;
+        }
+    }
+    return 0;
+}
+
+
+// ===== Phases =====
+
+/* Wait until the server has answered every connection's probe.
+ * Return: 0 on success and -1 on timeout or error
+ */
+static int admit_conns(uint64_t *elapsed_ns) {
+    uint64_t start = now_ns();
+    while (admitted_conns < opts.conns) {
+        if (now_ns() - start > ADMIT_TIMEOUT_NS) {
+            display_error("ERROR: ", "Timed out waiting for the server to admit connections");
+            return -1;
+        }
+        if (poll_conns(10) == -1) return -1;
+    }
+    // Measured from the first connect, not from when this loop started
+    *elapsed_ns = now_ns() - conns[0].opened;
+    return 0;
+}
+
+/* Broadcast a marker from the first connection until every connection
+ * has seen one, so measurement starts only once the server has
+ * registered all of them.
+ * Return: 0 on success and -1 on timeout or error
+ */
+static int sync_conns() {
+    uint64_t start = now_ns();
+    uint64_t last_probe = 0;
+    while (synced_conns < opts.conns) {
+        uint64_t now = now_ns();
+        if (now - start > SYNC_TIMEOUT_NS) {
+            display_error("ERROR: ", "Timed out waiting for the server to register connections");
+            return -1;
+        }
+        if (now - last_probe > 100000000ULL) {
+            if (queue_msg(&conns[0], SYNC_SEQ) == -1 || flush_conn(&conns[0]) == -1) return -1;
+            last_probe = now;
+        }
+        if (poll_conns(10) == -1) return -1;
+    }
+
+    // Let the remaining probes drain before counting anything
+    uint64_t settle = now_ns();
+    while (now_ns() - settle < 100000000ULL) {
+        if (poll_conns(10) == -1) return -1;
+    }
+    return 0;
+}
+
+/* Put connection i in room r<i % rooms> and wait for every confirmation.
+ * Return: 0 on success and -1 on timeout or error
+ */
+static int join_rooms() {
+    for (int i = 0; i < opts.conns; i++) {
+        char line[64];
+        int len = snprintf(line, sizeof(line), "\\join r%d\r\n", i % opts.rooms);
+        if (send(conns[i].fd, line, len, MSG_NOSIGNAL) != len) {
+            perror("send");
+            return -1;
+        }
+    }
+
+    uint64_t start = now_ns();
+    while (joined_conns < opts.conns) {
+        if (now_ns() - start > SYNC_TIMEOUT_NS) {
+            display_error("ERROR: ", "Timed out waiting for room joins");
+            return -1;
+        }
+        if (poll_conns(10) == -1) return -1;
+    }
+    return 0;
+}
+
+/* Return: how many connections receive what connection i sends
+ */
+static uint64_t recipients(int i) {
+    if (opts.rooms == 0) return (uint64_t)opts.conns;
+    int room = i % opts.rooms;
+    return (uint64_t)(opts.conns / opts.rooms + (room < opts.conns % opts.rooms ? 1 : 0));
+}
+
+/* Send at opts.rate until opts.duration has passed, round-robin over the
+ * senders, then wait for the broadcasts to arrive.
+ * Return: 0 on success and -1 on error
+ */
+static int run_load(uint64_t *elapsed_ns) {
+    uint64_t start = now_ns();
+    uint64_t duration_ns = (uint64_t)(opts.duration * 1e9);
+    int next_sender = 0;
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now - start >= duration_ns) break;
+
+        uint64_t due = opts.rate > 0 ? (uint64_t)((double)(now - start) * (double)opts.rate / 1e9)
+                                     : sent + (uint64_t)opts.senders;
+        int backed_up = 0;
+        while (sent < due && backed_up < opts.senders) {
+            int sender = next_sender;
+            next_sender = (next_sender + 1) % opts.senders;
+            int err = queue_msg(&conns[sender], sent);
+            if (err == -1) return -1;
+            if (err == 1) {
+                backed_up++;
+                continue;
+            }
+            backed_up = 0;
+            sent++;
+            expected += recipients(sender);
+        }
+        for (int i = 0; i < opts.senders; i++) {
+            if (conns[i].out_len > 0 && !conns[i].want_write) {
+                if (flush_conn(&conns[i]) == -1) return -1;
+            }
+        }
+        if (poll_conns(opts.rate > 0 ? 1 : 0) == -1) return -1;
+    }
+    *elapsed_ns = now_ns() - start;
+
+    uint64_t drain_start = now_ns();
+    while (delivered < expected && now_ns() - drain_start < DRAIN_TIMEOUT_NS) {
+        if (poll_conns(10) == -1) return -1;
+    }
+    return 0;
+}
+
+static void report_admit(uint64_t elapsed_ns) {
+    double ms = (double)elapsed_ns / 1e6;
+    printf("admitted %d conns in %.1f ms (%.0f conns/s)\n",
+           opts.conns, ms, opts.conns / (ms / 1e3));
+    printf("admit latency ms: p50 %.1f  p99 %.1f  max %.1f\n",
+           hist_percentile(&admit_latency, 50.0) / 1e6,
+           hist_percentile(&admit_latency, 99.0) / 1e6, admit_latency.max / 1e6);
+}
+
+static void report(uint64_t elapsed_ns) {
+    double secs = (double)elapsed_ns / 1e9;
+
+    printf("conns %d, senders %d, rooms %d, size %zu B, rate %ld msg/s, %.1f s\n",
+           opts.conns, opts.senders, opts.rooms, opts.size, opts.rate, secs);
+    printf("sent      %llu msgs (%.0f msg/s)\n",
+           (unsigned long long)sent, (double)sent / secs);
+    printf("delivered %llu of %llu (%.0f msg/s, %.1f MB/s), lost %llu\n",
+           (unsigned long long)delivered, (unsigned long long)expected,
+           (double)delivered / secs, (double)delivered_bytes / secs / 1e6,
+           (unsigned long long)(expected > delivered ? expected - delivered : 0));
+    printf("latency us: p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           hist_percentile(&latency, 50.0) / 1e3, hist_percentile(&latency, 99.0) / 1e3,
+           hist_percentile(&latency, 99.9) / 1e3, latency.max / 1e3);
+
+    // Coarse power-of-two view of the same histogram
+    printf("histogram (us):\n");
+    uint64_t bucket = 0;
+    uint64_t limit = 1000;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        while (hist_upper(i) >= limit) {
+            if (bucket > 0) {
+                printf("  < %8llu  %llu\n", (unsigned long long)(limit / 1000),
+                       (unsigned long long)bucket);
+            }
+            bucket = 0;
+            limit *= 2;
+        }
+        bucket += latency.counts[i];
+    }
+    if (bucket > 0) {
+        printf("  < %8llu  %llu\n", (unsigned long long)(limit / 1000),
+               (unsigned long long)bucket);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    if (parse_options(argc, argv) == -1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    uint64_t elapsed_ns = 0;
+    if (open_conns() == 0 && admit_conns(&elapsed_ns) == 0) {
+        report_admit(elapsed_ns);
+        if (opts.duration == 0) {
+            status = EXIT_SUCCESS;
+        } else if (sync_conns() == 0 && (opts.rooms == 0 || join_rooms() == 0) &&
+                   run_load(&elapsed_ns) == 0) {
+            report(elapsed_ns);
+            status = EXIT_SUCCESS;
+        }
+    }
+    close_conns();
+    return status;
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "io_helpers.h"
+#include "msglog.h"
+
+#define INDEX_SIZE (LOG_SEGMENT_ENTRIES * sizeof(uint64_t))
+
+/* A range of one segment the flusher still has to sync.
+ */
+typedef struct SyncRange {
+    LogMap *map;            // pinned while the flusher syncs it
+    char *data;
+    size_t data_from;
+    size_t data_to;
+    uint64_t *ends;
+    uint64_t ends_from;
+    uint64_t ends_to;
+} SyncRange;
+
+/* A run of messages found by msglog_read, handed out after unlocking.
+ */
+typedef struct Span {
+    const char *data;
+    size_t len;
+    LogMap *map;
+} Span;
+
+
+// ===== Segment files =====
+
+/* Map path shared and read-write, growing the file to size first.
+ * Return: the mapping or NULL on error
+ */
+static void *map_file(const char *path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || ((size_t)st.st_size < size && ftruncate(fd, size) < 0)) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    // The mapping keeps the file alive; the descriptor is not needed
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return map;
+}
+
+/* Map (creating if needed) the segment starting at first_seq and work
+ * out how many complete messages it holds.
+ * Return: 0 on success and -1 on error
+ */
+static int segment_open(const char *dir, uint64_t first_seq, LogSegment *seg) {
+    char path[PATH_MAX];
+    memset(seg, 0, sizeof(LogSegment));
+    seg->first_seq = first_seq;
+    seg->map = malloc(sizeof(LogMap));
+    if (!seg->map) {
+        perror("malloc");
+        return -1;
+    }
+    seg->map->refs = 1;
+
+    snprintf(path, sizeof(path), "%s/%020llu.log", dir, (unsigned long long)first_seq);
+    seg->data = map_file(path, LOG_SEGMENT_SIZE);
+    if (!seg->data) {
+        free(seg->map);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%020llu.idx", dir, (unsigned long long)first_seq);
+    seg->ends = map_file(path, INDEX_SIZE);
+    if (!seg->ends) {
+        munmap(seg->data, LOG_SEGMENT_SIZE);
+        free(seg->map);
+        return -1;
+    }
+    seg->map->data = seg->data;
+    seg->map->ends = seg->ends;
+
+    // Entries are written after their bytes, so the first entry that does
+    // not extend the previous one marks where an interrupted append stopped
+    uint64_t prev = 0;
+    while (seg->count < LOG_SEGMENT_ENTRIES && seg->ends[seg->count] > prev &&
+           seg->ends[seg->count] <= LOG_SEGMENT_SIZE) {
+        prev = seg->ends[seg->count];
+        seg->count++;
+    }
+    if (seg->count < LOG_SEGMENT_ENTRIES && seg->ends[seg->count] != 0) {
+        memset(seg->ends + seg->count, 0,
+               (LOG_SEGMENT_ENTRIES - seg->count) * sizeof(uint64_t));
+    }
+    seg->len = prev;
+    seg->synced_count = seg->count;
+    seg->synced_len = seg->len;
+    return 0;
+}
+
+void msglog_unpin(LogMap *map) {
+    if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(map->data, LOG_SEGMENT_SIZE);
+        munmap(map->ends, INDEX_SIZE);
+        free(map);
+    }
+}
+
+static void pin(LogMap *map) {
+    __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void segment_close(LogSegment *seg) {
+    msglog_unpin(seg->map);
+}
+
+static void remove_segment_files(const char *dir, uint64_t first_seq) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%020llu.log", dir, (unsigned long long)first_seq);
+    if (unlink(path) < 0 && errno != ENOENT) perror("unlink");
+    snprintf(path, sizeof(path), "%s/%020llu.idx", dir, (unsigned long long)first_seq);
+    if (unlink(path) < 0 && errno != ENOENT) perror("unlink");
+}
+
+/* Delete the oldest segments beyond log->keep, files first; their
+ * mappings go once no reader holds them.
+ * Prereq: the log is locked
+ */
+static void trim_segments(MsgLog *log) {
+    while (log->keep > 0 && log->segment_count > log->keep) {
+        LogSegment *oldest = &log->segments[0];
+        remove_segment_files(log->dir, oldest->first_seq);
+        segment_close(oldest);
+
+        memmove(log->segments, log->segments + 1, (log->segment_count - 1) * sizeof(LogSegment));
+        log->segment_count--;
+        if (log->synced_segment > 0) log->synced_segment--;
+    }
+}
+
+/* Return: 0 on success and -1 on error
+ */
+static int add_segment(MsgLog *log, uint64_t first_seq) {
+    if (log->segment_count == log->segment_cap) {
+        size_t new_cap = log->segment_cap ? log->segment_cap * 2 : 8;
+        LogSegment *segments = realloc(log->segments, new_cap * sizeof(LogSegment));
+        if (!segments) {
+            perror("realloc");
+            return -1;
+        }
+        log->segments = segments;
+        log->segment_cap = new_cap;
+    }
+    if (segment_open(log->dir, first_seq, &log->segments[log->segment_count]) < 0) {
+        return -1;
+    }
+    log->segment_count++;
+    return 0;
+}
+
+static int compare_seq(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Map every segment already in log->dir that is to be kept, oldest
+ * first.
+ * Return: 0 on success and -1 on error
+ */
+static int recover_segments(MsgLog *log) {
+    DIR *dir = opendir(log->dir);
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+
+    uint64_t *seqs = NULL;
+    size_t len = 0, cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long seq;
+        char tail;
+        if (strlen(entry->d_name) != 24 ||
+            sscanf(entry->d_name, "%20llu.lo%c", &seq, &tail) != 2 || tail != 'g') {
+            continue;
+        }
+        if (len == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *grown = realloc(seqs, cap * sizeof(uint64_t));
+            if (!grown) {
+                perror("realloc");
+                free(seqs);
+                closedir(dir);
+                return -1;
+            }
+            seqs = grown;
+        }
+        seqs[len++] = seq;
+    }
+    closedir(dir);
+
+    if (len > 0) {
+        qsort(seqs, len, sizeof(uint64_t), compare_seq);
+    }
+    // What a previous server kept beyond log->keep goes without being mapped
+    size_t skip = log->keep > 0 && len > log->keep ? len - log->keep : 0;
+    for (size_t i = 0; i < skip; i++) {
+        remove_segment_files(log->dir, seqs[i]);
+    }
+    for (size_t i = skip; i < len; i++) {
+        if (add_segment(log, seqs[i]) < 0) {
+            free(seqs);
+            return -1;
+        }
+    }
+    free(seqs);
+
+    if (log->segment_count > 0) {
+        LogSegment *last = &log->segments[log->segment_count - 1];
+        log->next_seq = last->first_seq + last->count;
+    }
+    return 0;
+}
+
+
+// ===== Group commit =====
+
+static void sync_range(void *base, size_t from, size_t to) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = from & ~(page - 1);
+    if (to > start && msync((char *)base + start, to - start, MS_SYNC) < 0) {
+        perror("msync");
+    }
+}
+
+/* Sync whatever was appended since the previous pass. Appends that land
+ * while a pass is running are picked up together by the next one.
+ */
+static void *flush_loop(void *arg) {
+    MsgLog *log = arg;
+    pthread_mutex_lock(&log->lock);
+    while (1) {
+        while (!log->dirty && !log->stopping) {
+            pthread_cond_wait(&log->wake, &log->lock);
+        }
+        if (!log->dirty) break;
+        log->dirty = 0;
+
+        size_t count = log->segment_count - log->synced_segment;
+        SyncRange *ranges = malloc(count * sizeof(SyncRange));
+        if (!ranges) {
+            perror("malloc");
+            continue;
+        }
+        for (size_t i = 0; i < count; i++) {
+            LogSegment *seg = &log->segments[log->synced_segment + i];
+            pin(seg->map);
+            ranges[i].map = seg->map;
+            ranges[i].data = seg->data;
+            ranges[i].data_from = seg->synced_len;
+            ranges[i].data_to = seg->len;
+            ranges[i].ends = seg->ends;
+            ranges[i].ends_from = seg->synced_count;
+            ranges[i].ends_to = seg->count;
+            seg->synced_len = seg->len;
+            seg->synced_count = seg->count;
+        }
+        log->synced_segment = log->segment_count - 1;
+        pthread_mutex_unlock(&log->lock);
+
+        // Data before index, so a synced entry never points at unsynced bytes
+        for (size_t i = 0; i < count; i++) {
+            sync_range(ranges[i].data, ranges[i].data_from, ranges[i].data_to);
+        }
+        for (size_t i = 0; i < count; i++) {
+            sync_range(ranges[i].ends, ranges[i].ends_from * sizeof(uint64_t),
+                       ranges[i].ends_to * sizeof(uint64_t));
+        }
+        for (size_t i = 0; i < count; i++) {
+            msglog_unpin(ranges[i].map);
+        }
+        free(ranges);
+
+        pthread_mutex_lock(&log->lock);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+
+// ===== Log =====
+
+MsgLog *msglog_open(const char *dir, size_t keep) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return NULL;
+    }
+
+    MsgLog *log = calloc(1, sizeof(MsgLog));
+    if (!log) {
+        perror("calloc");
+        return NULL;
+    }
+    log->dir = strdup(dir);
+    log->keep = keep;
+    log->next_seq = 1;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->wake, NULL);
+
+    if (!log->dir || recover_segments(log) < 0 ||
+        (log->segment_count == 0 && add_segment(log, log->next_seq) < 0)) {
+        msglog_close(log);
+        return NULL;
+    }
+    log->synced_segment = log->segment_count - 1;
+    return log;
+}
+
+int msglog_start(MsgLog *log) {
+    int err = pthread_create(&log->flusher, NULL, flush_loop, log);
+    if (err != 0) {
+        display_error("ERROR: Could not start log flusher: ", strerror(err));
+        return -1;
+    }
+    log->flushing = 1;
+    return 0;
+}
+
+void msglog_close(MsgLog *log) {
+    if (log->flushing) {
+        pthread_mutex_lock(&log->lock);
+        log->stopping = 1;
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(log->flusher, NULL);
+    }
+    for (size_t i = 0; i < log->segment_count; i++) {
+        segment_close(&log->segments[i]);
+    }
+    free(log->segments);
+    free(log->dir);
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->wake);
+    free(log);
+}
+
+uint64_t msglog_append(MsgLog *log, const char *data, size_t len) {
+    if (len == 0 || len > LOG_SEGMENT_SIZE) return 0;
+
+    pthread_mutex_lock(&log->lock);
+    LogSegment *seg = &log->segments[log->segment_count - 1];
+    if (seg->len + len > LOG_SEGMENT_SIZE || seg->count == LOG_SEGMENT_ENTRIES) {
+        if (add_segment(log, log->next_seq) < 0) {
+            pthread_mutex_unlock(&log->lock);
+            return 0;
+        }
+        trim_segments(log);
+        seg = &log->segments[log->segment_count - 1];
+    }
+
+    memcpy(seg->data + seg->len, data, len);
+    seg->len += len;
+    seg->ends[seg->count++] = seg->len;
+    uint64_t seq = log->next_seq++;
+
+    if (!log->dirty) {
+        log->dirty = 1;
+        pthread_cond_signal(&log->wake);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return seq;
+}
+
+void msglog_bounds(MsgLog *log, uint64_t *first, uint64_t *next) {
+    pthread_mutex_lock(&log->lock);
+    *first = log->segments[0].first_seq;
+    *next = log->next_seq;
+    pthread_mutex_unlock(&log->lock);
+}
+
+uint64_t msglog_read(MsgLog *log, uint64_t from, uint64_t to, LogSpanFn fn, void *arg) {
+    pthread_mutex_lock(&log->lock);
+    if (from < log->segments[0].first_seq) from = log->segments[0].first_seq;
+    if (to > log->next_seq) to = log->next_seq;
+    if (from >= to) {
+        pthread_mutex_unlock(&log->lock);
+        return 0;
+    }
+
+    // Last segment starting at or before from
+    size_t lo = 0, hi = log->segment_count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (log->segments[mid].first_seq <= from) lo = mid;
+        else hi = mid;
+    }
+
+    Span *spans = malloc((log->segment_count - lo) * sizeof(Span));
+    if (!spans) {
+        pthread_mutex_unlock(&log->lock);
+        perror("malloc");
+        return 0;
+    }
+    size_t span_count = 0;
+    uint64_t covered = 0;
+    for (size_t i = lo; i < log->segment_count && from < to; i++) {
+        LogSegment *seg = &log->segments[i];
+        if (from < seg->first_seq) from = seg->first_seq;
+        uint64_t first = from - seg->first_seq;
+        uint64_t last = to - seg->first_seq < seg->count ? to - seg->first_seq : seg->count;
+        if (first >= last) continue;
+
+        size_t start = first == 0 ? 0 : seg->ends[first - 1];
+        spans[span_count].data = seg->data + start;
+        spans[span_count].len = seg->ends[last - 1] - start;
+        spans[span_count].map = seg->map;
+        pin(seg->map);
+        span_count++;
+        covered += last - first;
+        from = seg->first_seq + last;
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    // The bytes are immutable once appended and pinned, so no lock is
+    // needed to use them
+    for (size_t i = 0; i < span_count; i++) {
+        fn(arg, spans[i].data, spans[i].len, spans[i].map);
+    }
+    free(spans);
+    return covered;
+}
@@ -0,0 +1,105 @@
+#ifndef __MSGLOG_H__
+#define __MSGLOG_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define LOG_SEGMENT_SIZE (16 * 1024 * 1024)    // message bytes per segment
+#define LOG_SEGMENT_ENTRIES (1024 * 1024)      // messages per segment
+
+/* The mappings of one segment. They stay until the log and everyone it
+ * handed a view into them have let go, so a retired segment's bytes
+ * outlive its files for as long as a reader still needs them.
+ */
+typedef struct LogMap {
+    char *data;
+    uint64_t *ends;
+    int refs;
+} LogMap;
+
+/* One segment of the log: <first_seq>.log holds the messages back to
+ * back and <first_seq>.idx the end offset of each, both mapped shared.
+ * A message's bytes are exactly what was broadcast, so any run of
+ * messages is one contiguous range of the mapping.
+ */
+typedef struct LogSegment {
+    LogMap *map;
+    uint64_t first_seq;
+    uint64_t count;
+    size_t len;             // bytes used in data
+    char *data;
+    uint64_t *ends;
+    uint64_t synced_count;  // entries covered by the last msync
+    size_t synced_len;
+} LogSegment;
+
+/* Append-only broadcast log shared by every server shard. Appends only
+ * write to the mappings; a flusher thread msyncs whatever accumulated
+ * since its previous pass, so one sync commits a whole group of them.
+ */
+typedef struct MsgLog {
+    char *dir;
+    size_t keep;            // most segments kept, 0 for all of them
+    LogSegment *segments;
+    size_t segment_count;
+    size_t segment_cap;
+    size_t synced_segment;  // first segment that may still have unsynced data
+    uint64_t next_seq;
+    int dirty;
+    int flushing;           // flusher thread started
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t flusher;
+} MsgLog;
+
+/* Called by msglog_read for each contiguous run of messages. fn owns a
+ * reference to map and gives it back with msglog_unpin once it is done
+ * with the bytes.
+ */
+typedef void (*LogSpanFn)(void *arg, const char *data, size_t len, LogMap *map);
+
+
+/* Open the log in dir, creating it if needed and recovering every
+ * message a previous server left there. With keep above 0, only the
+ * newest keep segments are kept and older ones are deleted as new ones
+ * start.
+ * Return: the log or NULL on error
+ */
+MsgLog *msglog_open(const char *dir, size_t keep);
+
+/* Start the thread that syncs appends, in the process that appends.
+ * Return: 0 on success and -1 on error
+ */
+int msglog_start(MsgLog *log);
+
+/* Stop the flusher if it runs, sync and unmap everything.
+ */
+void msglog_close(MsgLog *log);
+
+/* Append one message.
+ * Return: its sequence number, or 0 if it could not be stored
+ */
+uint64_t msglog_append(MsgLog *log, const char *data, size_t len);
+
+/* Return: the oldest stored sequence number, which moves up as old
+ * segments are deleted, and the next one to be assigned; the log holds
+ * [*first, *next)
+ */
+void msglog_bounds(MsgLog *log, uint64_t *first, uint64_t *next);
+
+/* Pass messages [from, to) to fn as views into the mapped segments, one
+ * call per segment touched. Each view stays valid until its map is
+ * unpinned, even if the segment is deleted or the log closed meanwhile.
+ * Return: number of messages covered
+ */
+uint64_t msglog_read(MsgLog *log, uint64_t from, uint64_t to, LogSpanFn fn, void *arg);
+
+/* Let go of a map passed to a LogSpanFn, unmapping it if nothing else
+ * holds it. Safe from any thread.
+ */
+void msglog_unpin(LogMap *map);
+
+#endif
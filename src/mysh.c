@@ -5,9 +5,11 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "builtins.h"
 #include "io_helpers.h"
+#include "commands.h"
 #include "variables.h"
 #include "server.h"
 
@@ -78,16 +80,51 @@ void cmd_ps() {
     }
 }
 
+/* Reap finished background jobs only; foreground commands and
+ * pipeline stages are waited for by pid where they were started.
+ */
 void handle_sigchld(int sig) {
     (void)sig; 
-    pid_t pid;
     int status;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        remove_bg_process(pid); 
+    int i = 0;
+    while (i < bg_count) {
+        pid_t pid = bg_processes[i].pid;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            remove_bg_process(pid);   // shifts the rest down to i
+        } else {
+            i++;
+        }
     }
 }
 
 
+/* A builtin pipeline stage running on a thread of the shell, reading
+ * in_fd and writing out_fd instead of the shell's stdin and stdout.
+ */
+typedef struct Stage {
+    char **argv;
+    bn_ptr fn;
+    int in_fd;
+    int out_fd;
+    int started;        // running on thread rather than forked
+    pthread_t thread;
+    ssize_t result;
+} Stage;
+
+void *run_stage(void *arg) {
+    Stage *stage = arg;
+    set_io_fds(stage->in_fd, stage->out_fd);
+    stage->result = stage->fn(stage->argv);
+    if (stage->result == -1) {
+        display_error("ERROR: Builtin failed: ", stage->argv[0]);
+    }
+    // Closing our ends at once lets the next stage see end of input, and
+    // a stage still writing to us get EPIPE rather than wait forever
+    if (stage->in_fd != STDIN_FILENO) close(stage->in_fd);
+    if (stage->out_fd != STDOUT_FILENO) close(stage->out_fd);
+    return NULL;
+}
+
 void handle_pipes(char **tokens, size_t token_count) {
     int num_cmds = 1;
 
@@ -120,10 +157,48 @@ void handle_pipes(char **tokens, size_t token_count) {
         }
     }
 
-    // Fork and execute commands
+    // Builtin stages run on threads with their own ends of the pipes;
+    // only external commands (and builtins that touch shell state) fork
+    Stage stages[num_cmds];
+    pid_t pids[num_cmds];
     for (int i = 0; i < num_cmds; i++) {
-        pid_t pid = fork();
-        if (pid == 0) {
+        stages[i].argv = cmds[i];
+        stages[i].fn = cmds[i][0] ? check_stage_builtin(cmds[i][0]) : NULL;
+        stages[i].in_fd = i > 0 ? pipes[i - 1][0] : STDIN_FILENO;
+        stages[i].out_fd = i < num_cmds - 1 ? pipes[i][1] : STDOUT_FILENO;
+        stages[i].started = 0;
+        pids[i] = -1;
+        if (stages[i].fn) {
+            // Stage threads start with every signal blocked. The handlers
+            // display_message, which on a stage would write into the
+            // pipeline, and with SIGPIPE blocked a write to a reader that
+            // went away fails with EPIPE instead of killing the shell
+            sigset_t all, old;
+            sigfillset(&all);
+            pthread_sigmask(SIG_BLOCK, &all, &old);
+            int err = pthread_create(&stages[i].thread, NULL, run_stage, &stages[i]);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            if (err == 0) {
+                stages[i].started = 1;
+                continue;
+            }
+            display_error("ERROR: Could not start stage: ", strerror(err));
+        }
+
+        // External commands are looked up here, once, rather than by
+        // execvp in every child
+        bn_ptr builtin_fn = cmds[i][0] ? check_builtin(cmds[i][0]) : NULL;
+        const char *path = NULL;
+        if (builtin_fn == NULL && cmds[i][0]) {
+            path = command_path(cmds[i][0]);
+            if (path == NULL) {
+                display_error("ERROR: Unknown command: ", cmds[i][0]);
+                continue;
+            }
+        }
+
+        pids[i] = fork();
+        if (pids[i] == 0) {
             // Child process
             if (i > 0) {
                 dup2(pipes[i - 1][0], STDIN_FILENO);
@@ -137,33 +212,48 @@ void handle_pipes(char **tokens, size_t token_count) {
                 close(pipes[j][1]);
             }
             // Execute command
-            bn_ptr builtin_fn = check_builtin(cmds[i][0]);
             if (builtin_fn != NULL) {
                 ssize_t err = builtin_fn(cmds[i]);
                 if (err == -1) {
                     display_error("ERROR: Builtin failed: ", cmds[i][0]);
                 }
                 exit(err == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
-            } else {
+            } else if (path != NULL) {
+                execv(path, cmds[i]);
+                // The remembered file may have moved since
                 execvp(cmds[i][0], cmds[i]);
                 display_error("ERROR: Unknown command: ", cmds[i][0]);
                 exit(EXIT_FAILURE);
+            } else {
+                exit(EXIT_FAILURE);
             }
+        } else if (pids[i] < 0) {
+            perror("fork");
         }
     }
 
-    // Parent closes all pipes
+    // Close the pipe ends no stage thread uses; children have their own
     for (int i = 0; i < num_cmds - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+        if (!stages[i + 1].started) close(pipes[i][0]);
+        if (!stages[i].started) close(pipes[i][1]);
+    }
+
+    // Join the stage threads, which close their own ends of the pipes
+    for (int i = 0; i < num_cmds; i++) {
+        if (!stages[i].started) continue;
+        pthread_join(stages[i].thread, NULL);
+        if (stages[i].result == -1) {
+            display_error("ERROR: Command failed: ", cmds[i][0]);
+        }
     }
 
     // Wait for all child processes
     for (int i = 0; i < num_cmds; i++) {
+        if (pids[i] <= 0) continue;
         int status;
-        wait(&status);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE) {
-            
+        if (waitpid(pids[i], &status, 0) == pids[i] &&
+            WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE) {
+            command_hash_check(cmds[i][0]);
             display_error("ERROR: Command failed: ", cmds[i][0]);
         }
     }
@@ -217,15 +307,23 @@ void execute_command(char **token_arr, size_t token_count,
                 }
             }
         } else {
+            // A command PATH has nothing for fails without a fork
+            const char *path = command_path(token_arr[0]);
+            if (path == NULL) {
+                display_error("ERROR: Unknown command: ", token_arr[0]);
+                return;
+            }
             pid_t pid = fork();
             if (pid == 0) {
+                execv(path, token_arr);
+                // The remembered file may have moved since
                 execvp(token_arr[0], token_arr);
                 exit(EXIT_FAILURE);
             } else if (pid > 0) {
                 int status;
-                wait(&status);
+                waitpid(pid, &status, 0);
                 if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE) {
-                    
+                    command_hash_check(token_arr[0]);
                     display_error("ERROR: Unknown command: ", token_arr[0]);
                 }
             } else {
@@ -382,6 +480,7 @@ int main(__attribute__((unused)) int argc,
         }
     }
     clean();
+    command_hash_reset();
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io_helpers.h"
+#include "pool.h"
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POOL_POISON(p, n) ASAN_POISON_MEMORY_REGION(p, n)
+#define POOL_UNPOISON(p, n) ASAN_UNPOISON_MEMORY_REGION(p, n)
+#else
+#define POOL_POISON(p, n) ((void)(p), (void)(n))
+#define POOL_UNPOISON(p, n) ((void)(p), (void)(n))
+#endif
+
+#define POOL_ALIGN 16
+#define SLAB_HEADER POOL_ALIGN      // holds the slab chain link
+
+/* A thread's free objects for one pool.
+ */
+typedef struct PoolCache {
+    void *head;
+    size_t len;
+} PoolCache;
+
+static int pool_count = 0;
+static __thread PoolCache caches[POOL_MAX];
+
+
+// ===== Freelists =====
+
+// A free object holds the next one's address in its first word
+static void *next_of(void *obj) {
+    return *(void **)obj;
+}
+
+static void set_next(void *obj, void *next) {
+    *(void **)obj = next;
+}
+
+/* Put obj on a freelist. Apart from the link, a free object is off
+ * limits to the sanitizer, so a use after pool_put is still caught.
+ */
+static void push(Pool *pool, void **head, void *obj) {
+    set_next(obj, *head);
+    *head = obj;
+    POOL_POISON((char *)obj + sizeof(void *), pool->size - sizeof(void *));
+}
+
+/* Carve a new slab onto the shared freelist, zeroed first when touch
+ * is set so its pages are resident before anyone needs them.
+ * Prereq: pool->lock is held
+ * Return: 0 on success and -1 on error
+ */
+static int add_slab(Pool *pool, int touch) {
+    size_t bytes = SLAB_HEADER + pool->per_slab * pool->size;
+    char *slab = malloc(bytes);
+    if (!slab) {
+        perror("malloc");
+        return -1;
+    }
+    if (touch) memset(slab, 0, bytes);
+    set_next(slab, pool->slabs);
+    pool->slabs = slab;
+    pool->slab_count++;
+
+    for (size_t i = pool->per_slab; i > 0; i--) {
+        push(pool, &pool->free, slab + SLAB_HEADER + (i - 1) * pool->size);
+    }
+    pool->free_len += pool->per_slab;
+    return 0;
+}
+
+
+// ===== Pools =====
+
+int pool_init(Pool *pool, size_t size) {
+    int index = __atomic_fetch_add(&pool_count, 1, __ATOMIC_RELAXED);
+    if (index >= POOL_MAX) {
+        display_error("ERROR: ", "Too many pools");
+        return -1;
+    }
+    memset(pool, 0, sizeof(Pool));
+    if (size < sizeof(void *)) size = sizeof(void *);
+    pool->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->per_slab = (POOL_SLAB - SLAB_HEADER) / pool->size;
+    if (pool->per_slab == 0) pool->per_slab = 1;
+    pool->index = index;
+    pthread_mutex_init(&pool->lock, NULL);
+    return 0;
+}
+
+int pool_reserve(Pool *pool, size_t count) {
+    int ret = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (ret == 0 && pool->free_len < count) {
+        ret = add_slab(pool, 1);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+void *pool_get(Pool *pool) {
+    PoolCache *cache = &caches[pool->index];
+    if (cache->head == NULL) {
+        // Take a batch from the shared list, growing it if that is empty
+        pthread_mutex_lock(&pool->lock);
+        if (pool->free_len == 0 && add_slab(pool, 0) < 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        while (pool->free_len > 0 && cache->len < POOL_CACHE / 2) {
+            void *obj = pool->free;
+            pool->free = next_of(obj);
+            pool->free_len--;
+            set_next(obj, cache->head);
+            cache->head = obj;
+            cache->len++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    void *obj = cache->head;
+    cache->head = next_of(obj);
+    cache->len--;
+    POOL_UNPOISON(obj, pool->size);
+    return obj;
+}
+
+void pool_put(Pool *pool, void *obj) {
+    PoolCache *cache = &caches[pool->index];
+    push(pool, &cache->head, obj);
+    cache->len++;
+    if (cache->len <= POOL_CACHE) return;
+
+    // Hand the older half back so a thread that only frees stays bounded
+    void *last = cache->head;
+    for (size_t i = 1; i < POOL_CACHE / 2; i++) {
+        last = next_of(last);
+    }
+    void *spill = next_of(last);
+    size_t spill_len = cache->len - POOL_CACHE / 2;
+    set_next(last, NULL);
+    cache->len = POOL_CACHE / 2;
+
+    void *tail = spill;
+    while (next_of(tail)) {
+        tail = next_of(tail);
+    }
+    pthread_mutex_lock(&pool->lock);
+    set_next(tail, pool->free);
+    pool->free = spill;
+    pool->free_len += spill_len;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,47 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+
+#define POOL_MAX 16             // pools a process may create
+#define POOL_SLAB (64 * 1024)   // bytes carved into objects at a time
+#define POOL_CACHE 64           // objects a thread keeps before handing half back
+
+/* Fixed-size objects carved out of slabs and recycled through freelists.
+ * Each thread keeps a small cache of free objects per pool, so most gets
+ * and puts touch neither malloc nor the lock; only batches of
+ * POOL_CACHE / 2 move between a cache and the shared list. An object may
+ * be put back by a different thread than the one that got it. Slabs are
+ * never returned to malloc, so a pool is as big as its busiest moment.
+ */
+typedef struct Pool {
+    size_t size;            // object size, rounded up to 16
+    size_t per_slab;
+    int index;              // slot in each thread's cache table
+    pthread_mutex_t lock;   // guards the fields below
+    void *free;             // shared freelist
+    size_t free_len;
+    void *slabs;            // chain of every slab, linked through their first word
+    size_t slab_count;
+} Pool;
+
+
+/* Set up pool for objects of size bytes. Nothing is allocated yet.
+ * Return: 0 on success and -1 if POOL_MAX pools already exist
+ */
+int pool_init(Pool *pool, size_t size);
+
+/* Allocate and touch slabs until at least count objects are free, so
+ * the first count gets take no page faults.
+ * Return: 0 on success and -1 on error
+ */
+int pool_reserve(Pool *pool, size_t count);
+
+/* Return: an uninitialised object, or NULL
+ */
+void *pool_get(Pool *pool);
+void pool_put(Pool *pool, void *obj);
+
+#endif
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "io_helpers.h"
+
+#define MAX_EVENTS 256
+#define READ_CHUNK (64 * 1024)
+#define SENDERS 10
+#define DELIVERIES_PER_SEC 50000  // the same for every connection count
+#define RUN_SECS 5
+#define SYNC_INTERVAL_NS (100ULL * 1000000ULL)
+#define SYNC_TIMEOUT_NS (10ULL * 1000000000ULL)
+#define QUIET_MS 300              // no data for this long means the server is idle
+#define DRAIN_TIMEOUT_NS (5ULL * 1000000000ULL)
+#define START_TIMEOUT_NS (2ULL * 1000000000ULL)
+#define STOP_WAIT_US 300000
+#define DEFAULT_PORT 30100        // below the usual ephemeral port range
+
+/* Connection-count scaling run for the chat server. For each count N
+ * (100, 1000 and 5000 unless given), start a fresh server, open N
+ * connections to it and have the first SENDERS of them send lines at
+ * DELIVERIES_PER_SEC / N a second for RUN_SECS, so every run asks the
+ * server for the same number of deliveries. The server's CPU time
+ * (utime + stime from /proc) over the run, divided by the lines that
+ * came back, is what one delivery costs it.
+ *
+ * Usage: scale [--port P] [N...]
+ */
+
+typedef struct Server {
+    pid_t shell;    // mysh, which forks the server
+    pid_t pid;      // the server itself
+    int input;      // mysh's stdin
+} Server;
+
+typedef struct Run {
+    int *fds;
+    unsigned long *lines;   // lines received per connection
+    int conns;
+    int epoll_fd;
+    unsigned long delivered;
+} Run;
+
+
+// ===== Helpers =====
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void usage() {
+    display_error("Usage: ", "scale [--port P] [N...]");
+}
+
+/* Return: 0 and the parsed value on success, -1 if str is not a number
+ * in [min, max]
+ */
+static int parse_long(const char *str, long min, long max, long *out) {
+    char *end;
+    errno = 0;
+    long value = strtol(str, &end, 10);
+    if (errno != 0 || *str == '\0' || *end != '\0' || value < min || value > max) {
+        return -1;
+    }
+    *out = value;
+    return 0;
+}
+
+/* Return: the parent of pid according to /proc, or -1 on error
+ */
+static pid_t parent_of(pid_t pid) {
+    char path[64];
+    char stat[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    size_t len = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[len] = '\0';
+    // The name in parentheses may hold spaces; fields after it do not
+    char *fields = strrchr(stat, ')');
+    int ppid;
+    if (!fields || sscanf(fields + 1, " %*c %d", &ppid) != 1) return -1;
+    return ppid;
+}
+
+/* Return: a child of parent, or -1 if it has none yet
+ */
+static pid_t child_of(pid_t parent) {
+    DIR *proc = opendir("/proc");
+    if (!proc) return -1;
+    pid_t found = -1;
+    struct dirent *entry;
+    while (found < 0 && (entry = readdir(proc)) != NULL) {
+        long pid;
+        if (parse_long(entry->d_name, 1, INT32_MAX, &pid) == 0 && parent_of(pid) == parent) {
+            found = (pid_t)pid;
+        }
+    }
+    closedir(proc);
+    return found;
+}
+
+/* Return: the CPU time pid has used, user and system, in seconds, or
+ * -1 on error
+ */
+static double cpu_secs(pid_t pid) {
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    size_t len = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[len] = '\0';
+    char *fields = strrchr(stat, ')');
+    unsigned long utime, stime;
+    // Fields 3 to 13 come before utime and stime
+    if (!fields || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                          &utime, &stime) != 2) {
+        return -1;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+// ===== Server =====
+
+/* Start a server on port through mysh, which runs it in a child.
+ * Return: 0 on success and -1 on error
+ */
+static int start_server(Server *server, int port) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    server->shell = fork();
+    if (server->shell < 0) {
+        perror("fork");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if (server->shell == 0) {
+        dup2(pipe_fds[0], STDIN_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        execl("./mysh", "mysh", (char *)NULL);
+        perror("execl");
+        _exit(1);
+    }
+    close(pipe_fds[0]);
+    server->input = pipe_fds[1];
+
+    char command[64];
+    int len = snprintf(command, sizeof(command), "start-server %d\n", port);
+    if (write(server->input, command, len) != len) {
+        perror("write");
+        return -1;
+    }
+    uint64_t deadline = now_ns() + START_TIMEOUT_NS;
+    while ((server->pid = child_of(server->shell)) < 0 && now_ns() < deadline) {
+        usleep(10000);
+    }
+    if (server->pid < 0) {
+        display_error("ERROR: ", "Server did not start");
+        return -1;
+    }
+    return 0;
+}
+
+/* Stop the server, then let mysh see the end of its input and exit.
+ */
+static void stop_server(Server *server) {
+    const char *command = "close-server\n";
+    if (write(server->input, command, strlen(command)) < 0) {
+        perror("write");
+    }
+    // mysh tokenizes a whole read, so nothing may follow in the same one
+    usleep(STOP_WAIT_US);
+    close(server->input);
+    waitpid(server->shell, NULL, 0);
+}
+
+
+// ===== Connections =====
+
+/* Return: 0 on success and -1 on error
+ */
+static int open_conns(Run *run, int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int i = 0; i < run->conns; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        run->fds[i] = fd;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            return -1;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        if (epoll_ctl(run->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_conns(Run *run) {
+    for (int i = 0; i < run->conns; i++) {
+        if (run->fds[i] >= 0) {
+            close(run->fds[i]);
+        }
+    }
+}
+
+/* Read whatever arrives within timeout_ms and count the lines.
+ * Return: number of lines read
+ */
+static unsigned long pump(Run *run, int timeout_ms) {
+    static char buf[READ_CHUNK];
+    struct epoll_event events[MAX_EVENTS];
+    unsigned long lines = 0;
+    int ready = epoll_wait(run->epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < ready; i++) {
+        int conn = (int)events[i].data.u32;
+        ssize_t n;
+        while ((n = recv(run->fds[conn], buf, sizeof(buf), 0)) > 0) {
+            for (char *at = buf; (at = memchr(at, '\n', buf + n - at)) != NULL; at++) {
+                run->lines[conn]++;
+                lines++;
+            }
+        }
+    }
+    run->delivered += lines;
+    return lines;
+}
+
+static int send_line(Run *run, int conn, const char *line) {
+    size_t len = strlen(line);
+    if (send(run->fds[conn], line, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+/* Broadcast from the first connection until every connection has seen
+ * one, which proves the server admitted them all, then wait for the
+ * server to go quiet.
+ * Return: 0 on success and -1 on timeout
+ */
+static int sync_conns(Run *run) {
+    uint64_t deadline = now_ns() + SYNC_TIMEOUT_NS;
+    int synced = 0;
+    while (synced < run->conns) {
+        if (now_ns() > deadline) {
+            display_error("ERROR: ", "Server did not admit every connection");
+            return -1;
+        }
+        if (send_line(run, 0, "scale sync\r\n") < 0) return -1;
+        uint64_t until = now_ns() + SYNC_INTERVAL_NS;
+        while (now_ns() < until) {
+            pump(run, 10);
+        }
+        while (synced < run->conns && run->lines[synced] > 0) {
+            synced++;
+        }
+    }
+    while (pump(run, QUIET_MS) > 0) {
+    }
+    return 0;
+}
+
+
+// ===== Run =====
+
+/* Measure the server at conns connections and print one report line.
+ * Return: 0 on success and -1 on error
+ */
+static int scale_run(int conns, int port) {
+    Run run = {0};
+    run.conns = conns;
+    run.fds = malloc(conns * sizeof(int));
+    run.lines = calloc(conns, sizeof(unsigned long));
+    run.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!run.fds || !run.lines || run.epoll_fd < 0) {
+        perror("scale");
+        free(run.fds);
+        free(run.lines);
+        return -1;
+    }
+    for (int i = 0; i < conns; i++) {
+        run.fds[i] = -1;
+    }
+
+    Server server;
+    int result = -1;
+    if (start_server(&server, port) < 0) goto out;
+    if (open_conns(&run, port) < 0 || sync_conns(&run) < 0) goto stop;
+
+    long msgs = (long)DELIVERIES_PER_SEC * RUN_SECS / conns;
+    if (msgs < 1) msgs = 1;
+    uint64_t interval = (uint64_t)RUN_SECS * 1000000000ULL / msgs;
+    unsigned long expected = (unsigned long)msgs * conns;
+    run.delivered = 0;
+
+    double cpu_start = cpu_secs(server.pid);
+    uint64_t start = now_ns();
+    for (long sent = 0; sent < msgs; sent++) {
+        char line[64];
+        snprintf(line, sizeof(line), "scale %ld\r\n", sent);
+        if (send_line(&run, (int)(sent % SENDERS % conns), line) < 0) goto stop;
+        uint64_t next = start + (uint64_t)(sent + 1) * interval;
+        for (uint64_t now = now_ns(); now < next; now = now_ns()) {
+            pump(&run, (int)((next - now) / 1000000));
+        }
+    }
+    uint64_t deadline = now_ns() + DRAIN_TIMEOUT_NS;
+    while (run.delivered < expected && now_ns() < deadline) {
+        pump(&run, QUIET_MS);
+    }
+    double cpu = cpu_secs(server.pid) - cpu_start;
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("%6d %7ld %10lu %10lu %8.1f%% %10.2f\n", conns, msgs, run.delivered, expected,
+           100 * cpu / secs, run.delivered ? 1e6 * cpu / run.delivered : 0.0);
+    fflush(stdout);
+    result = 0;
+
+stop:
+    close_conns(&run);
+    stop_server(&server);
+out:
+    close(run.epoll_fd);
+    free(run.fds);
+    free(run.lines);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    static const int default_counts[] = {100, 1000, 5000};
+    int counts[64];
+    int count_len = 0;
+    long port = DEFAULT_PORT;
+    for (int i = 1; i < argc; i++) {
+        long value;
+        if (strcmp(argv[i], "--port") == 0) {
+            if (i + 1 >= argc || parse_long(argv[++i], 1, 65535, &port) < 0) {
+                usage();
+                return 1;
+            }
+        } else if (count_len < 64 && parse_long(argv[i], 1, 1000000, &value) == 0) {
+            counts[count_len++] = (int)value;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (count_len == 0) {
+        memcpy(counts, default_counts, sizeof(default_counts));
+        count_len = 3;
+    }
+
+    // Every connection is an fd here and in the server, which inherits this
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%d senders, %d deliveries/s for %d s\n", SENDERS, DELIVERIES_PER_SEC, RUN_SECS);
+    printf(" conns    msgs  delivered   expected  server CPU  us/delivery\n");
+    for (int i = 0; i < count_len; i++) {
+        // A port per run, so none waits on the last one's sockets
+        if (scale_run(counts[i], (int)port + i) < 0) return 1;
+    }
+    return 0;
+}
@@ -1,251 +1,3625 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
-#include <sys/select.h>
+#include <stdarg.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include "bus.h"
+#include "history.h"
 #include "io_helpers.h"
+#include "msglog.h"
+#include "pool.h"
+#include "server.h"
+#include "timers.h"
+#include "uring.h"
 
-#define BUFFER_SIZE 1024
 #define MAX_USER_MSG 128
+#define MAX_EVENTS 64
+#define ACCEPT_BATCH 256         // connections taken per listen wakeup
+#define MAX_IOV 64
+#define MAX_LINE_LEN (64 * 1024)
+#define MAX_FRAME_LEN (1024 * 1024)
+#define FRAME_HEADER_LEN 4
+#define URING_ENTRIES 4096
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE BUFFER_SIZE
+#define URING_BUF_GROUP 0
+#define URING_SEND_LINKS 4
+#define MAX_ROOMS 1024
+#define MAX_ROOM_NAME 32
+#define SEND_POOL_SIZE 16        // connections the send builtin keeps open
+#define STREAM_CHUNK (64 * 1024)        // input read per call when streaming
+#define STREAM_BATCH (256 * 1024)       // encoded lines coalesced per write
+#define CLIENT_CHUNK (64 * 1024)        // start-client read size on either fd
+#define CLIENT_OUT_CAP (256 * 1024)     // start-client lines waiting for the socket
+#define PING_LINE "\\ping\r\n"
+#define SENDER_LINE "\\sender\r\n"
+#define PONG_LINE "\\pong\r\n"
+#define TOKEN_SCALE 1000         // rate limit tokens per message or byte
+#define MSG_CLASSES 7            // MsgBuf size classes, 64 bytes to 4 KiB
+#define MSG_CLASS_MIN 64
+#define MSG_RESERVE_MAX 1024     // largest class --reserve-msgs fills
+#define REPLAY_CHUNK (64 * 1024) // history copied per queued message when replaying
+#define SHIP_STALL_MS 1000       // a standby this long behind is dropped
+#define SHIP_SNDBUF (4 * 1024 * 1024)
+#define SHIP_QUEUE (8 * 1024 * 1024)  // records waiting for the standby
+#define SHIP_BATCH 1024          // history entries copied per snapshot send
+#define FOLLOW_BUF (256 * 1024)  // standby read size
+#define TAKEOVER_TRIES 1000      // binds of the primary's port, TAKEOVER_RETRY_MS apart
+#define TAKEOVER_RETRY_MS 1
+#define ACCEPT_RETRY_MS 100      // accepting pauses this long when out of fds
+
+/* A broadcast payload, allocated once and shared by every recipient
+ * queue (and every shard) that holds a reference to it. data points at
+ * the inline bytes, or for a view at a run of the mapped message log,
+ * whose mapping the view keeps pinned.
+ */
+typedef struct MsgBuf {
+    int refs;
+    int pool;           // size class it came from, -1 if from malloc
+    size_t len;
+    char *data;
+    struct MsgBuf *numbered;    // a broadcast with its sequence number in front, or NULL
+    LogMap *log_map;            // what a view points into, or NULL
+    char bytes[];
+} MsgBuf;
+
+/* Bounded ring of messages waiting for the socket to become writable.
+ * head_sent is how much of the oldest message has already gone out, and
+ * in_flight how many head messages an io_uring send still references.
+ */
+typedef struct OutQueue {
+    MsgBuf **items;
+    size_t head;
+    size_t len;
+    size_t cap;
+    size_t head_sent;
+    size_t in_flight;
+} OutQueue;
+
+/* The chain of linked sendmsgs an io_uring client has in flight, each
+ * covering up to MAX_IOV queued messages. The kernel reads the headers
+ * until the completions arrive; these come back in chain order.
+ */
+typedef struct UringSend {
+    struct msghdr hdr[URING_SEND_LINKS];
+    struct iovec iov[URING_SEND_LINKS][MAX_IOV];
+    size_t offered[URING_SEND_LINKS];
+    int parts;          // sendmsgs in the chain
+    int done;           // completions seen so far
+    size_t sent;        // bytes taken by the unbroken start of the chain
+    int broken;         // a part came back short, so the rest was cancelled
+    int failed;         // a part failed for real
+} UringSend;
+
+/* Bytes received from a client that do not form a whole message yet.
+ * Messages are parsed in place between start and end; the unparsed tail
+ * is only moved back to the front once the free space behind it runs out.
+ */
+typedef struct InBuf {
+    char *data;
+    size_t start;
+    size_t end;
+    size_t cap;
+    int discarding;     // skipping the rest of an over-long line
+} InBuf;
+
+/* Whether broadcasts go to the ship queue: not while no standby is
+ * connected, and not once it fell too far behind for the queue.
+ */
+typedef enum ShipState {
+    SHIP_NONE,
+    SHIP_LIVE,
+    SHIP_OVERFLOW
+} ShipState;
+
+/* How a client's input is split into messages. Clients start with
+ * \r\n-terminated lines and switch with the \binary command to frames
+ * of a 4-byte big-endian length followed by that many payload bytes.
+ */
+typedef enum Framing {
+    FRAMING_LINES,
+    FRAMING_LENGTH
+} Framing;
+
+/* A client's two token buckets, counted in 1/TOKEN_SCALE units so a
+ * millisecond's refill stays whole at any rate. Each holds up to one
+ * second of its rate; the byte bucket may go into debt so a message
+ * bigger than the burst still gets through, and pays for it later.
+ */
+typedef struct RateLimit {
+    int64_t msg_tokens;
+    int64_t byte_tokens;
+    uint64_t refilled;      // ms, shard clock
+    uint64_t until;         // ms input resumes while paused
+    int paused;             // input not read until then
+    int recv_stopped;       // io_uring: no recv armed while paused
+    int warned;             // told about the current run of drops
+    unsigned long delayed;
+    unsigned long dropped;
+} RateLimit;
 
 typedef struct ClientNode {
     int socket;
     int id;
+    int dead;           // dropped this tick, freed once the event batch is done
+    int want_write;     // EPOLLOUT currently requested
+    int dirty;          // on the shard's flush list for this tick
+    int inflight;       // io_uring operations still pointing at this node
+    Framing framing;
     char hostname[INET_ADDRSTRLEN];
-    struct ClientNode *next;
+    InBuf in;
+    OutQueue out;
+    UringSend *send;
+    size_t slot;        // index in the shard's client table
+    struct Membership *joined;
+    size_t joined_len;
+    size_t joined_cap;
+    int room;           // where plain messages go, -1 for everyone
+    Timer timer;        // next idle or heartbeat check
+    uint64_t last_input;    // ms, shard clock
+    int pinged;         // a ping went out since the last input
+    int numbered;       // broadcasts arrive as "#<seq> <text>"
+    int sender;         // said \sender: only sends, so gets no broadcasts and isn't counted
+    RateLimit rate;
+    struct ClientNode *next;        // graveyard chain
+    struct ClientNode *next_dirty;
 } ClientNode;
 
+/* Open-addressing map from client id to node. Linear probing with
+ * backward-shift deletion, so removals leave no tombstones behind.
+ */
+typedef struct IdMap {
+    ClientNode **slots;
+    size_t cap;         // power of two
+    size_t len;
+} IdMap;
+
+/* A message handed to another shard: for room members when room is set,
+ * else a broadcast when target is 0, otherwise a direct message for that
+ * client id, sent by from. With no msg, target is a listening socket
+ * for the shard to accept on.
+ */
+typedef struct InboxItem {
+    MsgBuf *msg;
+    int target;
+    int from;
+    int room;           // -1 when not a room message
+} InboxItem;
+
+/* A named room. The registry is shared by every shard and only grows;
+ * each shard counts its own members in shard_members so senders can
+ * skip shards that have none.
+ */
+typedef struct Room {
+    char name[MAX_ROOM_NAME + 1];
+    int *shard_members;     // per shard, written by that shard only
+} Room;
+
+/* The members of one room that live on a shard, packed for fan-out.
+ */
+typedef struct RoomMembers {
+    ClientNode **clients;
+    size_t len;
+    size_t cap;
+} RoomMembers;
+
+/* A room a client is in and its slot in that room's member array.
+ */
+typedef struct Membership {
+    int room;
+    size_t slot;
+} Membership;
+
+/* Listeners a shard stops watching when it runs out of descriptors.
+ */
+enum {
+    PAUSED_TCP = 1,
+    PAUSED_UNIX = 2
+};
+
+/* One shard's counters in the shared stats segment, padded to a cache
+ * line so shards never write to the same line.
+ */
+typedef struct StatsSlot {
+    ServerStats stats;
+} __attribute__((aligned(64))) StatsSlot;
+
+// Each counter has exactly one writer (its shard), so a relaxed store of
+// the new value is enough and readers never see a torn word
+#define STAT_ADD(shard, field, n) \
+    __atomic_store_n(&(shard)->stats->field, (shard)->stats->field + (n), __ATOMIC_RELAXED)
+#define STAT_SUB(shard, field, n) \
+    __atomic_store_n(&(shard)->stats->field, (shard)->stats->field - (n), __ATOMIC_RELAXED)
+
+/* One worker: its own listening socket, epoll set and clients. The
+ * clients sit in a dense table for broadcasts, indexed by socket in
+ * by_fd and by id in ids. Other shards hand it messages through the
+ * inbox, guarded by inbox_lock and signalled on inbox_fd (an eventfd).
+ */
+typedef struct Shard {
+    int index;
+    int listen_fd;
+    int epoll_fd;
+    int inbox_fd;
+    int spare_fd;       // held open so accept can shed a client at the fd limit
+    int accept_paused;  // PAUSED_* listeners left unwatched until accept_timer
+    Timer accept_timer;
+    int cpu;
+    Uring *ring;        // set when this shard runs the io_uring backend
+    char *recv_bufs;    // URING_BUF_COUNT provided buffers
+    uint64_t inbox_count;
+    ClientNode **clients;
+    size_t client_len;
+    size_t client_cap;
+    ClientNode **by_fd;
+    size_t by_fd_cap;
+    IdMap ids;
+    RoomMembers *rooms; // MAX_ROOMS, indexed by room id
+    int next_seq;       // ids are index + 1 + next_seq * shard_count
+    ClientNode *graveyard;
+    ClientNode *dirty;
+    ServerStats *stats; // this shard's slot in the shared stats segment
+    TimerWheel timers;
+    uint64_t now_ms;    // read once per loop pass
+    struct __kernel_timespec timer_ts;  // io_uring: deadline of the armed timeout
+    uint64_t timer_armed;   // ms the armed timeout fires, 0 if none
+    uint64_t timer_gen;     // tags the latest timeout so older ones are ignored
+    pthread_t thread;
+    pthread_mutex_t inbox_lock;
+    InboxItem *inbox;
+    size_t inbox_len;
+    size_t inbox_cap;
+    InboxItem *inbox_spare;     // the last batch's array, swapped in by the next
+    size_t inbox_spare_cap;
+} Shard;
+
+/* A connection the send builtin keeps open for the next send to the
+ * same server. fd is -1 for a free entry.
+ */
+typedef struct SendConn {
+    char host[sizeof(UNIX_PREFIX) + UNIX_PATH_LEN];
+    int port;
+    int fd;
+    unsigned long last_used;
+} SendConn;
+
 int server_running = 0;
-static int server_socket = -1;
 static int server_port = -1;
 static pid_t server_pid = -1;
-static ClientNode *clients = NULL;
-static int client_counter = 0;
+static Shard *shards = NULL;
+static int shard_count = 0;
+static ServerOptions server_opts;
+static int unix_listen_fd = -1;         // shared by every shard, unlike the TCP ones
+static MsgLog *msg_log = NULL;
+static MsgBus *fed_bus = NULL;          // joined by the shell, used by the server
+static History *history = NULL;         // recent broadcasts for \search
+static Room *rooms = NULL;              // MAX_ROOMS entries, room_count in use
+static int room_count = 0;
+static pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+static StatsSlot *stats_slots = NULL;   // shared with the shell, mapped before fork
+static int stats_count = 0;
+static struct timespec stats_started;
+static SendConn send_pool[SEND_POOL_SIZE];
+static unsigned long send_clock = 0;    // orders send_pool entries by last use
+static Pool msg_pools[MSG_CLASSES];     // MsgBufs by size class, larger ones use malloc
+static Pool client_pool;
+static Pool input_pool;                 // BUFFER_SIZE input buffers, larger ones use malloc
+static Pool queue_pool;                 // queue_limit entry outbound queues
+static Pool uring_send_pool;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;  // numbers the broadcasts
+static uint64_t stream_seq = 0;         // the latest broadcast's sequence number
+static int numbered_clients = 0;        // clients in \numbered mode, on any shard
+static int ship_listen_fd = -1;         // where a standby connects to the primary
+static pthread_mutex_t ship_lock = PTHREAD_MUTEX_INITIALIZER;  // guards the ship queue
+static char *ship_queue = NULL;         // records for the standby, a ring of SHIP_QUEUE bytes
+static size_t ship_head = 0;            // byte offsets into ship_queue, the tail sent next
+static size_t ship_tail = 0;
+static ShipState ship_state = SHIP_NONE;
+static int ship_wake_fd = -1;           // an eventfd the shipper waits on
+static int follow_fd = -1;              // a standby's connection to its primary
+static int standby_port = 0;            // the port a standby takes over
 
-// ======== Linked List Operations ========
+int uring_arm_recv(Shard *shard, ClientNode *client);
+static int send_all(int fd, const char *data, size_t len);
+int uring_arm_accept(Shard *shard, int listen_fd);
+static uint64_t monotonic_ms();
+static int open_listener(int port, int reuse_port, int report);
+int watch_listener(Shard *shard, int listen_fd, int op);
+static int open_unix_listener(const char *path);
+static int connect_unix(const char *path);
+void replay_history(Shard *shard, ClientNode *client, uint64_t from, uint64_t to);
+int uring_flush_client(Shard *shard, ClientNode *client);
+void close_send_pool();
+void schedule_client_timer(Shard *shard, ClientNode *client);
+void parse_input(Shard *shard, ClientNode *client);
 
-ClientNode *add_client(int client_sock, const char *hostname) {
-    ClientNode *new_client = malloc(sizeof(ClientNode));
-    if (!new_client) {
-        perror("malloc");
-        return NULL;
+// ======== Message Buffers ========
+
+/* Return: a buffer of size bytes in all with one reference, from the
+ * smallest size class it fits, or NULL
+ */
+static MsgBuf *msgbuf_new(size_t size) {
+    int class = 0;
+    while (class < MSG_CLASSES && ((size_t)MSG_CLASS_MIN << class) < size) {
+        class++;
+    }
+    MsgBuf *buf;
+    if (class < MSG_CLASSES) {
+        buf = pool_get(&msg_pools[class]);
+    } else {
+        buf = malloc(size);
+        if (!buf) perror("malloc");
+        class = -1;
+    }
+    if (buf) {
+        buf->refs = 1;
+        buf->pool = class;
+        buf->numbered = NULL;
+        buf->log_map = NULL;
+    }
+    return buf;
+}
+
+/* Return: an uninitialised, NUL terminated buffer of len bytes with one
+ * reference, or NULL
+ */
+MsgBuf *msgbuf_alloc(size_t len) {
+    MsgBuf *buf = msgbuf_new(sizeof(MsgBuf) + len + 1);
+    if (!buf) return NULL;
+    buf->len = len;
+    buf->data = buf->bytes;
+    buf->data[len] = '\0';
+    return buf;
+}
+
+/* Return: a buffer with one reference whose data is the len bytes at
+ * data, which must outlive it, or NULL
+ */
+MsgBuf *msgbuf_view(const char *data, size_t len) {
+    MsgBuf *buf = msgbuf_new(sizeof(MsgBuf));
+    if (!buf) return NULL;
+    buf->len = len;
+    buf->data = (char *)data;
+    return buf;
+}
+
+/* Return: a buffer holding the formatted text with one reference, or NULL
+ */
+MsgBuf *msgbuf_vprintf(const char *fmt, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (len < 0) return NULL;
+
+    MsgBuf *buf = msgbuf_alloc(len);
+    if (buf) {
+        vsnprintf(buf->data, len + 1, fmt, args);
+    }
+    return buf;
+}
+
+MsgBuf *msgbuf_printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    MsgBuf *buf = msgbuf_vprintf(fmt, args);
+    va_end(args);
+    return buf;
+}
+
+MsgBuf *msgbuf_ref(MsgBuf *buf) {
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void msgbuf_unref(MsgBuf *buf) {
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (buf->numbered) {
+            msgbuf_unref(buf->numbered);
+        }
+        if (buf->log_map) {
+            msglog_unpin(buf->log_map);
+        }
+        if (buf->pool >= 0) {
+            pool_put(&msg_pools[buf->pool], buf);
+        } else {
+            free(buf);
+        }
+    }
+}
+
+// ======== Broadcast Stream ========
+
+/* A broadcast as shipped to a standby: its sequence number and length,
+ * in host byte order since both ends are on one host, then the bytes.
+ */
+typedef struct ShipHeader {
+    uint64_t seq;
+    uint32_t len;
+} __attribute__((packed)) ShipHeader;
+
+/* Copy len bytes into the ship queue at byte offset at, which wraps.
+ */
+static void ship_copy(size_t at, const void *data, size_t len) {
+    size_t pos = at % SHIP_QUEUE;
+    size_t first = len < SHIP_QUEUE - pos ? len : SHIP_QUEUE - pos;
+    memcpy(ship_queue + pos, data, first);
+    memcpy(ship_queue, (const char *)data + first, len - first);
+}
+
+/* Queue a record for the standby, if one is live, and wake the shipper
+ * if the queue was empty. A standby SHIP_QUEUE behind is dropped rather
+ * than waited for. Called under stream_lock, which keeps records in order.
+ */
+static void ship_enqueue(uint64_t seq, const char *data, size_t len) {
+    ShipHeader header = {seq, (uint32_t)len};
+    size_t need = sizeof(header) + len;
+    int wake = 0;
+    pthread_mutex_lock(&ship_lock);
+    if (ship_state == SHIP_LIVE) {
+        if (ship_head - ship_tail + need > SHIP_QUEUE) {
+            ship_state = SHIP_OVERFLOW;
+            wake = 1;
+        } else {
+            wake = ship_head == ship_tail;
+            ship_copy(ship_head, &header, sizeof(header));
+            ship_copy(ship_head + sizeof(header), data, len);
+            ship_head += need;
+        }
+    }
+    pthread_mutex_unlock(&ship_lock);
+
+    if (wake) {
+        uint64_t one = 1;
+        if (write(ship_wake_fd, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+    }
+}
+
+/* Return: 0 and the sequence numbers that can be replayed, [*first,
+ * *next), or -1 if the server keeps neither a log nor a history
+ */
+int stream_bounds(uint64_t *first, uint64_t *next) {
+    if (msg_log) {
+        msglog_bounds(msg_log, first, next);
+    } else if (history) {
+        history_bounds(history, first, next);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Number a broadcast and keep it wherever the stream is kept: the log,
+ * the history and a standby's queue. Nothing under stream_lock blocks;
+ * the shipper thread sends the queue on its own.
+ */
+void record_broadcast(MsgBuf *msg) {
+    pthread_mutex_lock(&stream_lock);
+    uint64_t seq = msg_log ? msglog_append(msg_log, msg->data, msg->len) : stream_seq + 1;
+    if (seq != 0) {
+        stream_seq = seq;
+        if (history) {
+            history_append(history, seq, msg->data, msg->len);
+        }
+        ship_enqueue(seq, msg->data, msg->len);
+    }
+    pthread_mutex_unlock(&stream_lock);
+
+    if (seq == 0 || __atomic_load_n(&numbered_clients, __ATOMIC_RELAXED) == 0) return;
+    char tag[32];
+    int tag_len = snprintf(tag, sizeof(tag), "#%llu ", (unsigned long long)seq);
+    MsgBuf *numbered = msgbuf_alloc(tag_len + msg->len);
+    if (numbered) {
+        memcpy(numbered->data, tag, tag_len);
+        memcpy(numbered->data + tag_len, msg->data, msg->len);
+        msg->numbered = numbered;
+    }
+}
+
+// ======== Client Registry ========
+
+static size_t id_hash(int id, size_t cap) {
+    return ((uint32_t)id * 2654435761u) & (cap - 1);
+}
+
+ClientNode *idmap_get(IdMap *map, int id) {
+    if (map->cap == 0) return NULL;
+    for (size_t i = id_hash(id, map->cap); map->slots[i]; i = (i + 1) & (map->cap - 1)) {
+        if (map->slots[i]->id == id) return map->slots[i];
+    }
+    return NULL;
+}
+
+/* Return: 0 on success and -1 on error
+ */
+int idmap_put(IdMap *map, ClientNode *client) {
+    // Keep the load at or under half so probe runs stay short
+    if ((map->len + 1) * 2 > map->cap) {
+        size_t new_cap = map->cap ? map->cap * 2 : 64;
+        ClientNode **slots = calloc(new_cap, sizeof(ClientNode *));
+        if (!slots) {
+            perror("calloc");
+            return -1;
+        }
+        for (size_t i = 0; i < map->cap; i++) {
+            if (!map->slots[i]) continue;
+            size_t j = id_hash(map->slots[i]->id, new_cap);
+            while (slots[j]) j = (j + 1) & (new_cap - 1);
+            slots[j] = map->slots[i];
+        }
+        free(map->slots);
+        map->slots = slots;
+        map->cap = new_cap;
+    }
+
+    size_t i = id_hash(client->id, map->cap);
+    while (map->slots[i]) i = (i + 1) & (map->cap - 1);
+    map->slots[i] = client;
+    map->len++;
+    return 0;
+}
+
+void idmap_remove(IdMap *map, int id) {
+    if (map->cap == 0) return;
+    size_t mask = map->cap - 1;
+    size_t i = id_hash(id, map->cap);
+    while (map->slots[i] && map->slots[i]->id != id) i = (i + 1) & mask;
+    if (!map->slots[i]) return;
+
+    // Pull later entries of the probe run back over the hole
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!map->slots[j]) break;
+        size_t home = id_hash(map->slots[j]->id, map->cap);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            map->slots[i] = map->slots[j];
+            i = j;
+        }
+    }
+    map->slots[i] = NULL;
+    map->len--;
+}
+
+/* Return: the index of the shard that owns client id
+ */
+int shard_of(int id) {
+    return (id - 1) % shard_count;
+}
+
+/* Enter the client in the shard's table, fd index and id map.
+ * Return: 0 on success and -1 on error
+ */
+int registry_add(Shard *shard, ClientNode *client) {
+    if (shard->client_len == shard->client_cap) {
+        size_t new_cap = shard->client_cap ? shard->client_cap * 2 : 64;
+        ClientNode **clients = realloc(shard->clients, new_cap * sizeof(ClientNode *));
+        if (!clients) {
+            perror("realloc");
+            return -1;
+        }
+        shard->clients = clients;
+        shard->client_cap = new_cap;
+    }
+    if ((size_t)client->socket >= shard->by_fd_cap) {
+        size_t new_cap = shard->by_fd_cap ? shard->by_fd_cap : 64;
+        while (new_cap <= (size_t)client->socket) new_cap *= 2;
+        ClientNode **by_fd = realloc(shard->by_fd, new_cap * sizeof(ClientNode *));
+        if (!by_fd) {
+            perror("realloc");
+            return -1;
+        }
+        memset(by_fd + shard->by_fd_cap, 0, (new_cap - shard->by_fd_cap) * sizeof(ClientNode *));
+        shard->by_fd = by_fd;
+        shard->by_fd_cap = new_cap;
     }
+    if (idmap_put(&shard->ids, client) < 0) {
+        return -1;
+    }
+
+    client->slot = shard->client_len;
+    shard->clients[shard->client_len++] = client;
+    shard->by_fd[client->socket] = client;
+    return 0;
+}
+
+void registry_remove(Shard *shard, ClientNode *client) {
+    // Move the last client into the hole to keep the table dense
+    ClientNode *last = shard->clients[--shard->client_len];
+    shard->clients[client->slot] = last;
+    last->slot = client->slot;
+
+    shard->by_fd[client->socket] = NULL;
+    idmap_remove(&shard->ids, client->id);
+}
+
+void free_registry(Shard *shard) {
+    free(shard->clients);
+    free(shard->by_fd);
+    free(shard->ids.slots);
+    shard->clients = shard->by_fd = shard->ids.slots = NULL;
+    shard->client_len = shard->client_cap = shard->by_fd_cap = 0;
+    shard->ids.cap = shard->ids.len = 0;
+}
+
+ClientNode *add_client(Shard *shard, int client_sock, const char *hostname) {
+    ClientNode *new_client = pool_get(&client_pool);
+    if (!new_client) return NULL;
+    memset(new_client, 0, sizeof(ClientNode));
 
     new_client->socket = client_sock;
-    new_client->id = ++client_counter;
-    strncpy(new_client->hostname, hostname, INET_ADDRSTRLEN);
-    new_client->next = clients;
-    clients = new_client;
+    new_client->room = -1;
+    // Ids encode their shard, so any shard can route to one directly
+    new_client->id = shard->index + 1 + shard->next_seq++ * shard_count;
+    strncpy(new_client->hostname, hostname, INET_ADDRSTRLEN - 1);
+    if (registry_add(shard, new_client) < 0) {
+        pool_put(&client_pool, new_client);
+        return NULL;
+    }
+
+    if (shard->ring) {
+        if (uring_arm_recv(shard, new_client) < 0) {
+            registry_remove(shard, new_client);
+            pool_put(&client_pool, new_client);
+            return NULL;
+        }
+    } else {
+        // Register once; the event carries the node so no lookup is needed
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = new_client;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("epoll_ctl");
+            registry_remove(shard, new_client);
+            pool_put(&client_pool, new_client);
+            return NULL;
+        }
+    }
+
+    STAT_ADD(shard, clients, 1);
+    STAT_ADD(shard, accepted, 1);
+    new_client->last_input = shard->now_ms;
+    new_client->rate.msg_tokens = (int64_t)server_opts.rate_msgs * TOKEN_SCALE;
+    new_client->rate.byte_tokens = (int64_t)server_opts.rate_bytes * TOKEN_SCALE;
+    new_client->rate.refilled = shard->now_ms;
+    schedule_client_timer(shard, new_client);
+
+    uint64_t first, next;
+    if (server_opts.replay > 0 && stream_bounds(&first, &next) == 0) {
+        if (next > first) {
+            uint64_t count = (uint64_t)server_opts.replay;
+            replay_history(shard, new_client, next > count ? next - count : 0, next);
+        }
+    }
 
     return new_client;
 }
 
-void remove_client(int client_sock) {
-    ClientNode **current = &clients;
+// ======== Rooms ========
+
+/* Return: the id of the room called name, creating it if create is set,
+ * or -1 if there is none (or no space for another)
+ */
+int room_lookup(const char *name, int create) {
+    pthread_mutex_lock(&rooms_lock);
+    int id = -1;
+    for (int i = 0; i < room_count; i++) {
+        if (strcmp(rooms[i].name, name) == 0) {
+            id = i;
+            break;
+        }
+    }
+    if (id < 0 && create && room_count < MAX_ROOMS) {
+        Room *room = &rooms[room_count];
+        room->shard_members = calloc(shard_count, sizeof(int));
+        if (room->shard_members) {
+            strncpy(room->name, name, MAX_ROOM_NAME);
+            id = room_count++;
+        } else {
+            perror("calloc");
+        }
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    return id;
+}
+
+/* Return: index of room in the client's memberships, or -1
+ */
+int find_membership(ClientNode *client, int room) {
+    for (size_t i = 0; i < client->joined_len; i++) {
+        if (client->joined[i].room == room) return (int)i;
+    }
+    return -1;
+}
+
+/* Return: 0 on success and -1 on error
+ */
+int join_room(Shard *shard, ClientNode *client, int room) {
+    RoomMembers *members = &shard->rooms[room];
+    if (members->len == members->cap) {
+        size_t new_cap = members->cap ? members->cap * 2 : 16;
+        ClientNode **grown = realloc(members->clients, new_cap * sizeof(ClientNode *));
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        members->clients = grown;
+        members->cap = new_cap;
+    }
+    if (client->joined_len == client->joined_cap) {
+        size_t new_cap = client->joined_cap ? client->joined_cap * 2 : 4;
+        Membership *grown = realloc(client->joined, new_cap * sizeof(Membership));
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        client->joined = grown;
+        client->joined_cap = new_cap;
+    }
+
+    client->joined[client->joined_len].room = room;
+    client->joined[client->joined_len].slot = members->len;
+    client->joined_len++;
+    members->clients[members->len++] = client;
+    __atomic_add_fetch(&rooms[room].shard_members[shard->index], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Drop the client's index-th membership. If it was the room it talks
+ * in, it falls back to the most recently joined room left, or everyone.
+ */
+void leave_room(Shard *shard, ClientNode *client, size_t index) {
+    int room = client->joined[index].room;
+    size_t slot = client->joined[index].slot;
+
+    // Swap the last member into the hole and tell it where it moved
+    RoomMembers *members = &shard->rooms[room];
+    ClientNode *last = members->clients[--members->len];
+    members->clients[slot] = last;
+    if (last != client) {
+        last->joined[find_membership(last, room)].slot = slot;
+    }
+    __atomic_sub_fetch(&rooms[room].shard_members[shard->index], 1, __ATOMIC_RELAXED);
+
+    // Keep the memberships in join order so the fallback is predictable
+    memmove(&client->joined[index], &client->joined[index + 1],
+            (client->joined_len - index - 1) * sizeof(Membership));
+    client->joined_len--;
+    if (client->room == room) {
+        client->room = client->joined_len > 0 ? client->joined[client->joined_len - 1].room : -1;
+    }
+}
+
+void leave_all_rooms(Shard *shard, ClientNode *client) {
+    while (client->joined_len > 0) {
+        leave_room(shard, client, client->joined_len - 1);
+    }
+}
+
+void free_rooms(Shard *shard) {
+    if (!shard->rooms) return;
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        free(shard->rooms[i].clients);
+    }
+    free(shard->rooms);
+    shard->rooms = NULL;
+}
+
+void free_queue(OutQueue *queue) {
+    for (size_t i = 0; i < queue->len; i++) {
+        msgbuf_unref(queue->items[(queue->head + i) % queue->cap]);
+    }
+    if (queue->items) {
+        pool_put(&queue_pool, queue->items);
+    }
+    queue->items = NULL;
+    queue->head = queue->len = queue->cap = queue->head_sent = queue->in_flight = 0;
+}
+
+/* Unlink the client and close its socket. The node itself stays on the
+ * graveyard until the current event batch is done, since a later event
+ * in the same batch may still point at it, and under io_uring until its
+ * pending operations have completed.
+ */
+void remove_client(Shard *shard, ClientNode *client) {
+    registry_remove(shard, client);
+    leave_all_rooms(shard, client);
+    timer_cancel(&shard->timers, &client->timer);
+    if (client->numbered) {
+        __atomic_sub_fetch(&numbered_clients, 1, __ATOMIC_RELAXED);
+    }
+
+    if (shard->ring) {
+        // Wakes the pending recv and send so their completions come back
+        shutdown(client->socket, SHUT_RDWR);
+    } else {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
+    }
+    close(client->socket);
+    client->dead = 1;
+    if (!client->sender) STAT_SUB(shard, clients, 1);
+    STAT_SUB(shard, queued, client->out.len);
+    client->next = shard->graveyard;
+    shard->graveyard = client;
+}
+
+void free_client(ClientNode *client) {
+    free_queue(&client->out);
+    free(client->joined);
+    if (client->in.cap == BUFFER_SIZE) {
+        pool_put(&input_pool, client->in.data);
+    } else {
+        free(client->in.data);
+    }
+    if (client->send) {
+        pool_put(&uring_send_pool, client->send);
+    }
+    pool_put(&client_pool, client);
+}
+
+void reap_clients(Shard *shard) {
+    ClientNode **current = &shard->graveyard;
     while (*current) {
-        if ((*current)->socket == client_sock) {
-            ClientNode *temp = *current;
-            *current = (*current)->next;
+        ClientNode *temp = *current;
+        if (temp->inflight > 0) {
+            current = &temp->next;
+            continue;
+        }
+        *current = temp->next;
+        free_client(temp);
+    }
+}
+
+void cleanup_clients(Shard *shard) {
+    for (size_t i = 0; i < shard->client_len; i++) {
+        close(shard->clients[i]->socket);
+        free_client(shard->clients[i]);
+    }
+    free_registry(shard);
+    // The server is exiting, so nothing is left to complete
+    while (shard->graveyard) {
+        ClientNode *temp = shard->graveyard;
+        shard->graveyard = temp->next;
+        free_client(temp);
+    }
+}
+
+// ======== Outbound Queues ========
+
+/* Point the client's epoll registration at what it waits for: input
+ * unless its rate limit paused it, and output if want_write.
+ */
+void watch_client(Shard *shard, ClientNode *client, int want_write) {
+    struct epoll_event ev;
+    ev.events = (client->rate.paused ? 0 : EPOLLIN) | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = client;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, client->socket, &ev) < 0) {
+        perror("epoll_ctl");
+        return;
+    }
+    client->want_write = want_write;
+}
+
+void set_want_write(Shard *shard, ClientNode *client, int want) {
+    if (client->want_write == want) return;
+    watch_client(shard, client, want);
+}
 
-            close(temp->socket);
-            free(temp);
+/* Point iov at up to MAX_IOV queued messages from index first on,
+ * starting mid-way through the head if it was partly written.
+ * Return: number of iovecs filled; *offered is set to their total length
+ */
+size_t fill_iov(OutQueue *queue, size_t first, struct iovec *iov, size_t *offered) {
+    size_t count = queue->len - first < MAX_IOV ? queue->len - first : MAX_IOV;
+    *offered = 0;
+    for (size_t i = 0; i < count; i++) {
+        MsgBuf *buf = queue->items[(queue->head + first + i) % queue->cap];
+        size_t skip = first + i == 0 ? queue->head_sent : 0;
+        iov[i].iov_base = buf->data + skip;
+        iov[i].iov_len = buf->len - skip;
+        *offered += iov[i].iov_len;
+    }
+    return count;
+}
+
+/* Retire every queued message the kernel took in full.
+ */
+void retire_sent(Shard *shard, OutQueue *queue, size_t sent) {
+    while (queue->len > 0) {
+        MsgBuf *buf = queue->items[queue->head];
+        size_t remaining = buf->len - queue->head_sent;
+        if (sent < remaining) {
+            queue->head_sent += sent;
             break;
         }
-        current = &(*current)->next;
+        sent -= remaining;
+        queue->head = (queue->head + 1) % queue->cap;
+        queue->len--;
+        queue->head_sent = 0;
+        STAT_ADD(shard, msgs_out, 1);
+        STAT_ADD(shard, bytes_out, buf->len);
+        STAT_SUB(shard, queued, 1);
+        msgbuf_unref(buf);
+    }
+}
+
+/* Write as much of the queue as the socket takes without blocking,
+ * gathering up to MAX_IOV queued messages into each sendmsg call.
+ * Return: 0 on success and -1 if the client was dropped
+ */
+int flush_client(Shard *shard, ClientNode *client) {
+    if (shard->ring) {
+        return uring_flush_client(shard, client);
+    }
+
+    OutQueue *queue = &client->out;
+    while (queue->len > 0) {
+        struct iovec iov[MAX_IOV];
+        size_t offered;
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = fill_iov(queue, 0, iov, &offered);
+        ssize_t sent = sendmsg(client->socket, &hdr, MSG_NOSIGNAL);
+        STAT_ADD(shard, write_calls, 1);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            remove_client(shard, client);
+            return -1;
+        }
+
+        retire_sent(shard, queue, sent);
+        // A short write means the socket buffer is full; wait for EPOLLOUT
+        if ((size_t)sent < offered) break;
     }
+
+    set_want_write(shard, client, queue->len > 0);
+    return 0;
 }
 
-void cleanup_clients() {
-    ClientNode *current = clients;
-    while (current) {
-        ClientNode *temp = current;
-        current = current->next;
-        close(temp->socket);
-        free(temp);
+/* Flush every client that had messages queued during this tick, so a
+ * burst of broadcasts costs one sendmsg per client instead of one each.
+ */
+void flush_dirty(Shard *shard) {
+    while (shard->dirty) {
+        ClientNode *client = shard->dirty;
+        shard->dirty = client->next_dirty;
+        client->dirty = 0;
+        if (!client->dead) {
+            flush_client(shard, client);
+        }
     }
-    clients = NULL;
-    client_counter = 0;
 }
 
-// ======== Server Functions ========
+/* Queue a reference to msg for one client, applying the slow-client
+ * policy if its queue is full. The write happens in flush_dirty.
+ * Return: 0 on success and -1 if the client was dropped
+ */
+int enqueue_message(Shard *shard, ClientNode *client, MsgBuf *msg) {
+    OutQueue *queue = &client->out;
+    if (queue->items == NULL) {
+        queue->cap = server_opts.queue_limit;
+        queue->items = pool_get(&queue_pool);
+        if (!queue->items) {
+            // Nowhere to keep the message; drop the client as a full queue would
+            queue->cap = 0;
+            STAT_ADD(shard, queue_failures, 1);
+            remove_client(shard, client);
+            return -1;
+        }
+    }
 
-void broadcast_message(char *msg) {
-    display_message(msg);
-    display_message("\n");
-    
-    ClientNode *current = clients;
-    while (current) {
-        if (send(current->socket, msg, strlen(msg), 0) < 0) {
-            perror("send");
+    if (queue->len == queue->cap) {
+        switch (server_opts.slow_policy) {
+        case SLOW_DROP_NEWEST:
+            STAT_ADD(shard, dropped_newest, 1);
+            return 0;
+        case SLOW_DISCONNECT:
+            STAT_ADD(shard, slow_disconnects, 1);
+            remove_client(shard, client);
+            return -1;
+        case SLOW_DROP_OLDEST:
+        default: {
+            // Messages being written have to finish; drop the oldest after them
+            size_t pinned = queue->in_flight;
+            if (pinned == 0 && queue->head_sent > 0) pinned = 1;
+            if (pinned >= queue->len) {
+                STAT_ADD(shard, dropped_newest, 1);
+                return 0;
+            }
+            size_t victim = (queue->head + pinned) % queue->cap;
+            msgbuf_unref(queue->items[victim]);
+            for (size_t i = pinned; i > 0; i--) {
+                queue->items[(queue->head + i) % queue->cap] =
+                    queue->items[(queue->head + i - 1) % queue->cap];
+            }
+            queue->head = (queue->head + 1) % queue->cap;
+            queue->len--;
+            STAT_ADD(shard, dropped_oldest, 1);
+            STAT_SUB(shard, queued, 1);
+            break;
         }
-        current = current->next;
+        }
+    }
+
+    queue->items[(queue->head + queue->len) % queue->cap] = msgbuf_ref(msg);
+    queue->len++;
+    STAT_ADD(shard, queued, 1);
+
+    if (!client->dirty && !client->want_write) {
+        client->dirty = 1;
+        client->next_dirty = shard->dirty;
+        shard->dirty = client;
     }
+    return 0;
 }
 
-void run_server() {
-    fd_set read_fds;
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100000; // 100ms timeout
+// ======== Cross-shard Channel ========
+
+/* Hand another shard item, taking a reference to its message if it has
+ * one, and wake the shard if its inbox was empty.
+ */
+void post_to_shard(Shard *shard, InboxItem item) {
+    pthread_mutex_lock(&shard->inbox_lock);
+    if (shard->inbox_len == shard->inbox_cap) {
+        size_t new_cap = shard->inbox_cap ? shard->inbox_cap * 2 : 16;
+        InboxItem *new_inbox = realloc(shard->inbox, new_cap * sizeof(InboxItem));
+        if (!new_inbox) {
+            pthread_mutex_unlock(&shard->inbox_lock);
+            perror("realloc");
+            return;
+        }
+        shard->inbox = new_inbox;
+        shard->inbox_cap = new_cap;
+    }
+    int was_empty = shard->inbox_len == 0;
+    if (item.msg) {
+        msgbuf_ref(item.msg);
+    }
+    shard->inbox[shard->inbox_len++] = item;
+    pthread_mutex_unlock(&shard->inbox_lock);
+
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(shard->inbox_fd, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+    }
+}
+
+// ======== Federation ========
+
+/* The thread following the federation bus. It is no shard, but keeps
+ * its counters in a stats slot of its own all the same.
+ */
+typedef struct BusReader {
+    ServerStats *stats;
+    BusCursor cursor;
+    pthread_t thread;
+} BusReader;
+
+static BusReader bus_reader;
+
+/* A peer's broadcast: log it like one of ours and hand it to every
+ * shard, as a shard does with its own.
+ */
+static void bus_deliver(void *arg, const char *data, size_t len) {
+    BusReader *reader = arg;
+    MsgBuf *msg = msgbuf_alloc(len);
+    if (!msg) return;
+    memcpy(msg->data, data, len);
+    record_broadcast(msg);
+    for (int i = 0; i < shard_count; i++) {
+        post_to_shard(&shards[i], (InboxItem){msg, 0, 0, -1});
+    }
+    msgbuf_unref(msg);
+    STAT_ADD(reader, bus_in, 1);
+}
 
+void *run_bus_reader(void *arg) {
+    BusReader *reader = arg;
     while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(server_socket, &read_fds);
-        int max_fd = server_socket;
+        // Anything published after seen was read cuts the wait short
+        uint32_t seen = bus_seq(fed_bus);
+        unsigned long lost = 0;
+        bus_read(fed_bus, &reader->cursor, bus_deliver, reader, &lost);
+        if (lost > 0) {
+            STAT_ADD(reader, bus_lost, lost);
+        }
+        bus_wait(fed_bus, &reader->cursor, seen);
+    }
+    return NULL;
+}
 
-        // Add all client sockets to fd_set
-        ClientNode *current = clients;
-        while (current) {
-            FD_SET(current->socket, &read_fds);
-            if (current->socket > max_fd) {
-                max_fd = current->socket;
-            }
-            current = current->next;
+// ======== Standby ========
+
+/* Records copied out of the history for a new standby, since the
+ * history may reuse their bytes once it is unlocked.
+ */
+typedef struct ShipBatch {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} ShipBatch;
+
+static void ship_snapshot(void *arg, uint64_t seq, const char *data, size_t len) {
+    ShipBatch *batch = arg;
+    ShipHeader header = {seq, (uint32_t)len};
+    size_t need = batch->len + sizeof(header) + len;
+    if (batch->failed) return;
+    if (need > batch->cap) {
+        size_t new_cap = batch->cap ? batch->cap : REPLAY_CHUNK;
+        while (new_cap < need) new_cap *= 2;
+        char *new_data = realloc(batch->data, new_cap);
+        if (!new_data) {
+            perror("realloc");
+            batch->failed = 1;
+            return;
+        }
+        batch->data = new_data;
+        batch->cap = new_cap;
+    }
+    memcpy(batch->data + batch->len, &header, sizeof(header));
+    memcpy(batch->data + batch->len + sizeof(header), data, len);
+    batch->len = need;
+}
+
+/* Stop queueing for the standby and forget what was queued.
+ */
+static void ship_stop() {
+    pthread_mutex_lock(&ship_lock);
+    ship_state = SHIP_NONE;
+    ship_head = ship_tail = 0;
+    pthread_mutex_unlock(&ship_lock);
+}
+
+/* Start queueing broadcasts for a new standby, then send it the history
+ * before them, SHIP_BATCH entries at a time, with no lock held while
+ * sending. Broadcasts meanwhile wait in the queue.
+ * Return: 0 on success and -1 on error
+ */
+static int ship_start(int fd) {
+    pthread_mutex_lock(&stream_lock);
+    pthread_mutex_lock(&ship_lock);
+    ship_state = SHIP_LIVE;
+    ship_head = ship_tail = 0;
+    pthread_mutex_unlock(&ship_lock);
+    uint64_t end = stream_seq + 1;
+    pthread_mutex_unlock(&stream_lock);
+
+    ShipBatch batch = {NULL, 0, 0, 0};
+    uint64_t first = end, next;
+    if (history) {
+        history_bounds(history, &first, &next);
+    }
+    for (uint64_t from = first; from < end && !batch.failed; from += SHIP_BATCH) {
+        uint64_t to = end - from > SHIP_BATCH ? from + SHIP_BATCH : end;
+        batch.len = 0;
+        history_read(history, from, to, ship_snapshot, &batch);
+        if (!batch.failed && send_all(fd, batch.data, batch.len) < 0) {
+            batch.failed = 1;
         }
+    }
+    free(batch.data);
+    return batch.failed ? -1 : 0;
+}
 
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (activity < 0 && errno != EINTR) {
-            perror("select");
-            break;
+/* Send the standby everything queued for it, waiting up to
+ * SHIP_STALL_MS (the socket's send timeout) while its buffer is full.
+ * Return: 0 on success and -1 if it is gone, stalled or fell behind
+ */
+static int ship_drain(int fd) {
+    while (1) {
+        pthread_mutex_lock(&ship_lock);
+        if (ship_state != SHIP_LIVE) {
+            pthread_mutex_unlock(&ship_lock);
+            return -1;
         }
+        size_t tail = ship_tail, head = ship_head;
+        pthread_mutex_unlock(&ship_lock);
+        if (head == tail) return 0;
 
-        // Check for new connections
-        if (FD_ISSET(server_socket, &read_fds)) {
-            struct sockaddr_in client_addr;
-            socklen_t addr_len = sizeof(client_addr);
-            int new_socket = accept(server_socket, 
-                                   (struct sockaddr *)&client_addr, 
-                                   &addr_len);
-            
-            if (new_socket < 0) {
-                perror("accept");
-                break;
+        // Only the bytes up to head are sent, which enqueue leaves alone
+        size_t pos = tail % SHIP_QUEUE;
+        size_t len = head - tail;
+        size_t first = len < SHIP_QUEUE - pos ? len : SHIP_QUEUE - pos;
+        if (send_all(fd, ship_queue + pos, first) < 0 ||
+            send_all(fd, ship_queue, len - first) < 0) {
+            return -1;
+        }
+        pthread_mutex_lock(&ship_lock);
+        ship_tail = head;
+        pthread_mutex_unlock(&ship_lock);
+    }
+}
+
+/* Accept standbys on ship_listen_fd, one at a time. Each gets the history
+ * so far and then every broadcast, from the queue record_broadcast
+ * fills. A standby that stalls or falls SHIP_QUEUE behind is dropped.
+ */
+void *run_shipper(void *arg) {
+    (void)arg;
+    int fd = -1;
+    while (1) {
+        struct pollfd pfds[2] = {{ship_listen_fd, POLLIN, 0}, {ship_wake_fd, POLLIN, 0}};
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return NULL;
+        }
+        if (pfds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(ship_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("read");
+            }
+            if (fd >= 0 && ship_drain(fd) < 0) {
+                ship_stop();
+                close(fd);
+                fd = -1;
+                display_error("WARNING: ", "Standby dropped");
             }
+        }
+        if (!(pfds[0].revents & POLLIN)) continue;
+
+        int new_fd = accept4(ship_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (new_fd < 0) continue;
+        if (fd >= 0) {
+            close(new_fd);
+            continue;
+        }
+        int size = SHIP_SNDBUF;
+        struct timeval stall = {SHIP_STALL_MS / 1000, (SHIP_STALL_MS % 1000) * 1000};
+        setsockopt(new_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        setsockopt(new_fd, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+        if (ship_start(new_fd) < 0 || ship_drain(new_fd) < 0) {
+            ship_stop();
+            close(new_fd);
+        } else {
+            fd = new_fd;
+        }
+    }
+    return NULL;
+}
+
+/* Start shipping the stream to standbys connecting at ship_listen_fd.
+ * Return: 0 on success and -1 on error
+ */
+static int start_shipper() {
+    if (!ship_queue) {
+        ship_queue = malloc(SHIP_QUEUE);
+        if (!ship_queue) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    if (ship_wake_fd < 0) {
+        ship_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ship_wake_fd < 0) {
+            perror("eventfd");
+            return -1;
+        }
+    }
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, run_shipper, NULL);
+    if (err != 0) {
+        display_error("ERROR: Could not start shipper: ", strerror(err));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/* Return: 1 if something accepts connections on the socket at path
+ */
+static int path_in_use(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return 0;
+    int used = connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(sock);
+    return used;
+}
+
+/* Sleep between attempts to take over what the primary held.
+ */
+static void takeover_pause() {
+    struct timespec pause = {0, TAKEOVER_RETRY_MS * 1000000L};
+    nanosleep(&pause, NULL);
+}
+
+/* Start accepting on a listening socket handed over by the standby
+ * thread, on this shard's own backend.
+ */
+void adopt_listener(Shard *shard, int fd) {
+    shard->listen_fd = fd;
+    if (shard->ring) {
+        uring_arm_accept(shard, fd);
+        return;
+    }
+    if (watch_listener(shard, fd, EPOLL_CTL_ADD) < 0) {
+        perror("epoll_ctl");
+    }
+}
+
+/* The primary is gone: bind its port on every shard and ship to a
+ * standby of our own. Its sockets may outlive it briefly (io_uring
+ * workers hold its files until they exit), so both are retried.
+ */
+static void take_over() {
+    uint64_t started = monotonic_ms();
+    int taken = 0;
+    for (int i = 0; i < shard_count; i++) {
+        int fd = -1;
+        for (int try = 1; fd < 0 && try <= TAKEOVER_TRIES; try++) {
+            fd = open_listener(standby_port, shard_count > 1, try == TAKEOVER_TRIES);
+            if (fd < 0 && try < TAKEOVER_TRIES) {
+                takeover_pause();
+            }
+        }
+        if (fd < 0) break;
+        post_to_shard(&shards[i], (InboxItem){NULL, fd, 0, -1});
+        taken++;
+    }
+    if (taken < shard_count) {
+        display_error("ERROR: ", "Standby could not take over the port");
+        return;
+    }
+
+    pthread_mutex_lock(&stream_lock);
+    uint64_t seq = stream_seq;
+    pthread_mutex_unlock(&stream_lock);
+    char note[128];
+    snprintf(note, sizeof(note), "Took over port %d at #%llu in %llu ms\n", standby_port,
+             (unsigned long long)seq, (unsigned long long)(monotonic_ms() - started));
+    display_message(note);
+
+    for (int try = 1; try < TAKEOVER_TRIES && path_in_use(server_opts.standby); try++) {
+        takeover_pause();
+    }
+    ship_listen_fd = open_unix_listener(server_opts.standby);
+    if (ship_listen_fd >= 0) {
+        start_shipper();
+    }
+}
+
+/* A standby applies the records its primary ships to its own history
+ * until the connection ends, then takes over.
+ */
+void *run_follower(void *arg) {
+    (void)arg;
+    size_t cap = FOLLOW_BUF, have = 0;
+    char *buf = malloc(cap);
+    if (!buf) {
+        perror("malloc");
+        return NULL;
+    }
+    while (1) {
+        ssize_t n = read(follow_fd, buf + have, cap - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += n;
+
+        size_t at = 0;
+        ShipHeader header;
+        while (have - at >= sizeof(header)) {
+            memcpy(&header, buf + at, sizeof(header));
+            size_t whole = sizeof(header) + header.len;
+            if (have - at < whole) break;
+            pthread_mutex_lock(&stream_lock);
+            if (header.seq > stream_seq) {
+                stream_seq = header.seq;
+                history_append(history, header.seq, buf + at + sizeof(header), header.len);
+            }
+            pthread_mutex_unlock(&stream_lock);
+            at += whole;
+        }
+        memmove(buf, buf + at, have - at);
+        have -= at;
+
+        // Grow for a record bigger than the buffer; no frame is over MAX_FRAME_LEN
+        if (have >= sizeof(header)) {
+            memcpy(&header, buf, sizeof(header));
+            size_t whole = sizeof(header) + header.len;
+            if (header.len > MAX_FRAME_LEN + MAX_USER_MSG) break;
+            if (whole > cap) {
+                char *bigger = realloc(buf, whole);
+                if (!bigger) break;
+                buf = bigger;
+                cap = whole;
+            }
+        }
+    }
+    free(buf);
+    close(follow_fd);
+    follow_fd = -1;
+    take_over();
+    return NULL;
+}
+
+// ======== Server Functions ========
+
+/* Queue msg for the clients owned by this shard only.
+ */
+void deliver_local(Shard *shard, MsgBuf *msg) {
+    // Walk backwards: a client dropped here is replaced by one already done
+    for (size_t i = shard->client_len; i > 0; i--) {
+        ClientNode *client = shard->clients[i - 1];
+        if (client->sender) continue;
+        enqueue_message(shard, client, client->numbered && msg->numbered ? msg->numbered : msg);
+    }
+}
+
+/* Queue msg for client target on this shard, or tell the sender from
+ * (possibly on another shard) that there is no such client.
+ */
+void deliver_direct(Shard *shard, MsgBuf *msg, int target, int from) {
+    ClientNode *client = idmap_get(&shard->ids, target);
+    if (client && !client->sender) {
+        enqueue_message(shard, client, msg);
+        return;
+    }
+    if (from == 0) return;
+
+    MsgBuf *error = msgbuf_printf("Error: no client %d\r\n", target);
+    if (!error) return;
+    Shard *home = &shards[shard_of(from)];
+    if (home == shard) {
+        deliver_direct(shard, error, from, 0);
+    } else {
+        post_to_shard(home, (InboxItem){error, from, 0, -1});
+    }
+    msgbuf_unref(error);
+}
+
+/* Route msg to client target wherever it lives.
+ */
+void send_direct(Shard *shard, MsgBuf *msg, int target, int from) {
+    Shard *owner = &shards[shard_of(target)];
+    if (owner == shard) {
+        deliver_direct(shard, msg, target, from);
+    } else {
+        post_to_shard(owner, (InboxItem){msg, target, from, -1});
+    }
+}
+
+/* Queue msg for this shard's members of room.
+ */
+void deliver_room(Shard *shard, MsgBuf *msg, int room) {
+    RoomMembers *members = &shard->rooms[room];
+    for (size_t i = members->len; i > 0; i--) {
+        enqueue_message(shard, members->clients[i - 1], msg);
+    }
+}
+
+/* Send msg to the members of room on every shard that has any.
+ */
+void send_to_room(Shard *shard, MsgBuf *msg, int room) {
+    if (server_opts.echo && write(STDOUT_FILENO, msg->data, msg->len) < 0) {
+        perror("write");
+    }
+
+    deliver_room(shard, msg, room);
+    for (int i = 0; i < shard_count; i++) {
+        if (&shards[i] != shard &&
+            __atomic_load_n(&rooms[room].shard_members[i], __ATOMIC_RELAXED) > 0) {
+            post_to_shard(&shards[i], (InboxItem){msg, 0, 0, room});
+        }
+    }
+}
+
+void broadcast_message(Shard *shard, MsgBuf *msg) {
+    // display_message stops at MAX_STR_LEN, so write the whole line
+    if (server_opts.echo && write(STDOUT_FILENO, msg->data, msg->len) < 0) {
+        perror("write");
+    }
+
+    record_broadcast(msg);
+    // Peers deliver it to their own clients; it never comes back here
+    if (fed_bus && bus_publish(fed_bus, msg->data, msg->len) == 0) {
+        STAT_ADD(shard, bus_out, 1);
+    }
+
+    deliver_local(shard, msg);
+    for (int i = 0; i < shard_count; i++) {
+        if (&shards[i] != shard) {
+            post_to_shard(&shards[i], (InboxItem){msg, 0, 0, -1});
+        }
+    }
+}
+
+void deliver_inbox(Shard *shard) {
+    // Take the whole batch under the lock, deliver it without holding it
+    pthread_mutex_lock(&shard->inbox_lock);
+    InboxItem *batch = shard->inbox;
+    size_t batch_len = shard->inbox_len;
+    size_t batch_cap = shard->inbox_cap;
+    shard->inbox = shard->inbox_spare;
+    shard->inbox_len = 0;
+    shard->inbox_cap = shard->inbox_spare_cap;
+    pthread_mutex_unlock(&shard->inbox_lock);
+
+    for (size_t i = 0; i < batch_len; i++) {
+        if (!batch[i].msg) {
+            adopt_listener(shard, batch[i].target);
+            continue;
+        }
+        if (batch[i].room >= 0) {
+            deliver_room(shard, batch[i].msg, batch[i].room);
+        } else if (batch[i].target == 0) {
+            deliver_local(shard, batch[i].msg);
+        } else {
+            deliver_direct(shard, batch[i].msg, batch[i].target, batch[i].from);
+        }
+        msgbuf_unref(batch[i].msg);
+    }
+    // Only this shard swaps the spare, so it is free to reuse next time
+    shard->inbox_spare = batch;
+    shard->inbox_spare_cap = batch_cap;
+}
+
+void drain_inbox(Shard *shard) {
+    uint64_t pending;
+    if (read(shard->inbox_fd, &pending, sizeof(pending)) < 0 && errno != EAGAIN) {
+        perror("read");
+    }
+    deliver_inbox(shard);
+}
+
+/* Queue a formatted reply for one client only.
+ * Return: 0 on success and -1 if the client was dropped
+ */
+int send_reply(Shard *shard, ClientNode *client, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    MsgBuf *reply = msgbuf_vprintf(fmt, args);
+    va_end(args);
+    if (!reply) return 0;
+
+    int err = enqueue_message(shard, client, reply);
+    msgbuf_unref(reply);
+    return err;
+}
+
+/* Where msglog_read or history_read should queue the history it finds.
+ */
+typedef struct ReplayTarget {
+    Shard *shard;
+    ClientNode *client;
+    MsgBuf *chunk;      // history_read: messages copied but not queued yet
+    size_t chunk_cap;
+} ReplayTarget;
+
+void replay_span(void *arg, const char *data, size_t len, LogMap *map) {
+    ReplayTarget *target = arg;
+    MsgBuf *view = target->client->dead ? NULL : msgbuf_view(data, len);
+    if (!view) {
+        msglog_unpin(map);
+        return;
+    }
+    // Queue the mapped bytes themselves; sendmsg reads them from the log,
+    // which the view keeps mapped even if the segment is deleted
+    view->log_map = map;
+    enqueue_message(target->shard, target->client, view);
+    msgbuf_unref(view);
+}
+
+void flush_replay(ReplayTarget *target) {
+    if (!target->chunk) return;
+    if (!target->client->dead) {
+        enqueue_message(target->shard, target->client, target->chunk);
+    }
+    msgbuf_unref(target->chunk);
+    target->chunk = NULL;
+}
+
+/* Copy a message out of the history, which may reuse its bytes once
+ * unlocked, into chunks of REPLAY_CHUNK so a long replay takes few
+ * queue slots. Numbered clients get each one's number in front.
+ */
+void replay_entry(void *arg, uint64_t seq, const char *data, size_t len) {
+    ReplayTarget *target = arg;
+    char tag[32];
+    int tag_len = target->client->numbered
+        ? snprintf(tag, sizeof(tag), "#%llu ", (unsigned long long)seq) : 0;
+    size_t need = tag_len + len;
+    if (target->chunk && target->chunk->len + need > target->chunk_cap) {
+        flush_replay(target);
+    }
+    if (!target->chunk) {
+        target->chunk_cap = need > REPLAY_CHUNK ? need : REPLAY_CHUNK;
+        target->chunk = msgbuf_alloc(target->chunk_cap);
+        if (!target->chunk) return;
+        target->chunk->len = 0;
+    }
+    MsgBuf *chunk = target->chunk;
+    memcpy(chunk->data + chunk->len, tag, tag_len);
+    memcpy(chunk->data + chunk->len + tag_len, data, len);
+    chunk->len += need;
+}
+
+/* Send the client logged or kept broadcasts [from, to), after a header
+ * naming the sequence numbers it covers.
+ */
+void replay_history(Shard *shard, ClientNode *client, uint64_t from, uint64_t to) {
+    uint64_t first, next;
+    if (stream_bounds(&first, &next) < 0) {
+        send_reply(shard, client, "Error: no message log\r\n");
+        return;
+    }
+    if (from < first) from = first;
+    if (to > next) to = next;
+    if (from >= to) {
+        send_reply(shard, client, "History: none\r\n");
+        return;
+    }
+
+    if (send_reply(shard, client, "History: %llu-%llu\r\n",
+                   (unsigned long long)from, (unsigned long long)(to - 1)) < 0) {
+        return;
+    }
+    ReplayTarget target = {shard, client, NULL, 0};
+    if (msg_log && (!client->numbered || !history)) {
+        msglog_read(msg_log, from, to, replay_span, &target);
+    } else if (history) {
+        history_read(history, from, to, replay_entry, &target);
+        flush_replay(&target);
+    }
+}
+
+/* The matches of one search, each already formatted for the client.
+ */
+typedef struct SearchResults {
+    MsgBuf *msgs[HISTORY_RESULTS];
+    size_t len;
+} SearchResults;
+
+void search_match(void *arg, time_t when, const char *data, size_t len) {
+    SearchResults *results = arg;
+    struct tm tm;
+    localtime_r(&when, &tm);
+    // Copied now, since the ring may reuse the bytes once it is unlocked
+    MsgBuf *msg = msgbuf_printf("[%02d:%02d:%02d] %.*s", tm.tm_hour, tm.tm_min, tm.tm_sec,
+                                (int)len, data);
+    if (msg) {
+        results->msgs[results->len++] = msg;
+    }
+}
+
+/* Handle "\search <term...>" with the recent broadcasts that contain
+ * every term, oldest first, after a header counting them.
+ */
+void handle_search(Shard *shard, ClientNode *client, const char *query, size_t len) {
+    if (!history) {
+        send_reply(shard, client, "Error: no history kept\r\n");
+        return;
+    }
+
+    SearchResults results = {{NULL}, 0};
+    if (history_search(history, query, len, search_match, &results) < 0) {
+        send_reply(shard, client, "Usage: \\search <term...>\r\n");
+        return;
+    }
+    int ok = send_reply(shard, client, "Search: %zu match%s\r\n", results.len,
+                        results.len == 1 ? "" : "es") == 0;
+    for (size_t i = 0; i < results.len; i++) {
+        if (ok && !client->dead) {
+            enqueue_message(shard, client, results.msgs[i]);
+        }
+        msgbuf_unref(results.msgs[i]);
+    }
+}
+
+/* Return: 0 and the number in args on success, -1 if args is not one
+ */
+int parse_count(const char *args, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(args, &end, 10);
+    if (errno != 0 || end == args || *end != '\0' || *args == '-') return -1;
+    *out = value;
+    return 0;
+}
+
+/* Handle "\msg <id> <text>" by sending text to client id alone.
+ * Prereq: args is NUL terminated after len bytes
+ */
+void handle_direct(Shard *shard, ClientNode *client, const char *args, size_t len) {
+    char *end;
+    long target = strtol(args, &end, 10);
+    if (end == args || *end != ' ' || target < 1 || target > INT_MAX) {
+        send_reply(shard, client, "Usage: \\msg <id> <text>\r\n");
+        return;
+    }
+    const char *text = end + 1;
+    size_t text_len = len - (text - args);
+
+    MsgBuf *msg = msgbuf_printf("client %d (private): %.*s\r\n", client->id, (int)text_len, text);
+    if (msg) {
+        send_direct(shard, msg, (int)target, client->id);
+        msgbuf_unref(msg);
+    }
+}
+
+/* Return: 1 if name can be a room name (1 to MAX_ROOM_NAME printable
+ * characters, no spaces), 0 otherwise
+ */
+int valid_room_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_ROOM_NAME) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] <= ' ' || name[i] > '~') return 0;
+    }
+    return 1;
+}
+
+/* Handle "\join <room>": subscribe to room and talk in it from now on.
+ * Prereq: name is NUL terminated
+ */
+void handle_join(Shard *shard, ClientNode *client, const char *name) {
+    if (!valid_room_name(name)) {
+        send_reply(shard, client, "Usage: \\join <room>\r\n");
+        return;
+    }
+    if (client->sender) {
+        send_reply(shard, client, "Error: a sender cannot join rooms\r\n");
+        return;
+    }
+    int room = room_lookup(name, 1);
+    if (room < 0) {
+        send_reply(shard, client, "Error: too many rooms\r\n");
+        return;
+    }
+    if (find_membership(client, room) < 0 && join_room(shard, client, room) < 0) {
+        send_reply(shard, client, "Error: could not join %s\r\n", name);
+        return;
+    }
+    client->room = room;
+    send_reply(shard, client, "Joined %s\r\n", name);
+}
+
+/* Handle "\leave <room>".
+ * Prereq: name is NUL terminated
+ */
+void handle_leave(Shard *shard, ClientNode *client, const char *name) {
+    int room = valid_room_name(name) ? room_lookup(name, 0) : -1;
+    int index = room >= 0 ? find_membership(client, room) : -1;
+    if (index < 0) {
+        send_reply(shard, client, "Error: not in room %s\r\n", name);
+        return;
+    }
+    leave_room(shard, client, index);
+    send_reply(shard, client, "Left %s\r\n", name);
+}
+
+/* Prereq: text points at len bytes inside the client's input buffer.
+ */
+void handle_message(Shard *shard, ClientNode *client, const char *text, size_t len) {
+    STAT_ADD(shard, msgs_in, 1);
+
+    // Handle special commands
+    if (client->framing == FRAMING_LINES && len >= 10 &&
+        strncmp(text, "\\connected", 10) == 0) {
+        ServerStats total;
+        double uptime;
+        server_stats(&total, &uptime);
+        send_reply(shard, client, "Client %d: %lu clients connected\r\n",
+                   client->id, total.clients);
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len >= 6 &&
+        strncmp(text, "\\last ", 6) == 0) {
+        uint64_t count;
+        if (parse_count(text + 6, &count) < 0) {
+            send_reply(shard, client, "Usage: \\last <count>\r\n");
+            return;
+        }
+        uint64_t first, next;
+        if (stream_bounds(&first, &next) < 0) next = 0;
+        replay_history(shard, client, next > count ? next - count : 0, UINT64_MAX);
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len >= 7 &&
+        strncmp(text, "\\since ", 7) == 0) {
+        uint64_t seq;
+        if (parse_count(text + 7, &seq) < 0) {
+            send_reply(shard, client, "Usage: \\since <seq>\r\n");
+            return;
+        }
+        replay_history(shard, client, seq, UINT64_MAX);
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len >= 7 &&
+        strncmp(text, "\\search", 7) == 0 && (len == 7 || text[7] == ' ')) {
+        handle_search(shard, client, text + 7, len - 7);
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len >= 6 &&
+        strncmp(text, "\\join ", 6) == 0) {
+        handle_join(shard, client, text + 6);
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len >= 7 &&
+        strncmp(text, "\\leave ", 7) == 0) {
+        handle_leave(shard, client, text + 7);
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len >= 5 &&
+        strncmp(text, "\\msg ", 5) == 0) {
+        handle_direct(shard, client, text + 5, len - 5);
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len == 6 &&
+        strncmp(text, "\\stats", 6) == 0) {
+        ServerStats total;
+        double uptime;
+        server_stats(&total, &uptime);
+        send_reply(shard, client,
+                   "Stats: %lu clients, %lu msgs in, %lu msgs out, %lu bytes in, "
+                   "%lu bytes out, %lu queued, %lu dropped, %.0fs up\r\n",
+                   total.clients, total.msgs_in, total.msgs_out, total.bytes_in,
+                   total.bytes_out, total.queued,
+                   total.dropped_oldest + total.dropped_newest + total.slow_disconnects +
+                   total.queue_failures,
+                   uptime);
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len == 7 &&
+        strncmp(text, "\\limits", 7) == 0) {
+        send_reply(shard, client, "Limits: %d msgs/s, %d bytes/s, %lu delayed, %lu dropped\r\n",
+                   server_opts.rate_msgs, server_opts.rate_bytes,
+                   client->rate.delayed, client->rate.dropped);
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len == 5 &&
+        strncmp(text, "\\pong", 5) == 0) {
+        // Answers a heartbeat; receiving it was all that mattered
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len == 9 &&
+        strncmp(text, "\\numbered", 9) == 0) {
+        if (!client->numbered) {
+            client->numbered = 1;
+            __atomic_add_fetch(&numbered_clients, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len == 7 &&
+        strncmp(text, "\\sender", 7) == 0) {
+        // A pooled send connection: it never reads, so it is left out of
+        // broadcasts, the client count and heartbeats. It may not be in a
+        // room, where it would receive the room's messages
+        if (!client->sender && client->joined_len == 0) {
+            client->sender = 1;
+            STAT_SUB(shard, clients, 1);
+            timer_cancel(&shard->timers, &client->timer);
+            schedule_client_timer(shard, client);
+        }
+        return;
+    }
+    if (client->framing == FRAMING_LINES && len == 7 &&
+        strncmp(text, "\\binary", 7) == 0) {
+        client->framing = FRAMING_LENGTH;
+        return;
+    }
+
+    // Broadcast regular message, built once for every recipient
+    char prefix[64];
+    int prefix_len = client->room >= 0
+        ? snprintf(prefix, sizeof(prefix), "client %d [%s]: ", client->id, rooms[client->room].name)
+        : snprintf(prefix, sizeof(prefix), "client %d: ", client->id);
+    MsgBuf *msg = msgbuf_alloc(prefix_len + len + 2);
+    if (msg) {
+        memcpy(msg->data, prefix, prefix_len);
+        memcpy(msg->data + prefix_len, text, len);
+        memcpy(msg->data + prefix_len + len, "\r\n", 2);
+        if (client->room >= 0) {
+            send_to_room(shard, msg, client->room);
+        } else {
+            broadcast_message(shard, msg);
+        }
+        msgbuf_unref(msg);
+    }
+}
+
+/* Add elapsed ms worth of rate to a bucket, capped at one second's worth.
+ */
+static void refill_bucket(int64_t *tokens, uint64_t elapsed, int rate) {
+    int64_t full = (int64_t)rate * TOKEN_SCALE;
+    // Past a second every bucket is full, and the product cannot overflow
+    if (elapsed >= 1000 || *tokens + (int64_t)elapsed * rate >= full) {
+        *tokens = full;
+    } else {
+        *tokens += (int64_t)elapsed * rate;
+    }
+}
+
+/* Take one message of bytes from the client's buckets. Integer math on
+ * the shard clock, so the check allocates nothing and makes no syscall.
+ * Return: 1 if the message may go ahead, else 0 with rate.until set to
+ * when it could
+ */
+int admit_input(Shard *shard, ClientNode *client, size_t bytes) {
+    if (server_opts.rate_msgs == 0 && server_opts.rate_bytes == 0) return 1;
+
+    RateLimit *rate = &client->rate;
+    uint64_t elapsed = shard->now_ms - rate->refilled;
+    rate->refilled = shard->now_ms;
+    uint64_t wait = 0;
+    if (server_opts.rate_msgs > 0) {
+        refill_bucket(&rate->msg_tokens, elapsed, server_opts.rate_msgs);
+        if (rate->msg_tokens < TOKEN_SCALE) {
+            uint64_t need = TOKEN_SCALE - rate->msg_tokens;
+            wait = (need + server_opts.rate_msgs - 1) / server_opts.rate_msgs;
+        }
+    }
+    if (server_opts.rate_bytes > 0) {
+        refill_bucket(&rate->byte_tokens, elapsed, server_opts.rate_bytes);
+        if (rate->byte_tokens <= 0) {
+            uint64_t need = 1 - rate->byte_tokens;
+            uint64_t byte_wait = (need + server_opts.rate_bytes - 1) / server_opts.rate_bytes;
+            if (byte_wait > wait) wait = byte_wait;
+        }
+    }
+    if (wait > 0) {
+        rate->until = shard->now_ms + wait;
+        return 0;
+    }
+
+    if (server_opts.rate_msgs > 0) rate->msg_tokens -= TOKEN_SCALE;
+    if (server_opts.rate_bytes > 0) rate->byte_tokens -= (int64_t)bytes * TOKEN_SCALE;
+    rate->warned = 0;
+    return 1;
+}
+
+/* Stop reading from a client that is over its rate until it has tokens
+ * again. Unread input backs up into the socket buffers and, through TCP
+ * flow control, the sender.
+ */
+void pause_input(Shard *shard, ClientNode *client) {
+    client->rate.paused = 1;
+    client->rate.delayed++;
+    STAT_ADD(shard, throttle_delays, 1);
+    if (!shard->ring) {
+        watch_client(shard, client, client->want_write);
+    }
+    schedule_client_timer(shard, client);
+}
+
+void resume_input(Shard *shard, ClientNode *client) {
+    client->rate.paused = 0;
+    if (!shard->ring) {
+        watch_client(shard, client, client->want_write);
+    } else if (client->rate.recv_stopped) {
+        client->rate.recv_stopped = 0;
+        uring_arm_recv(shard, client);
+    }
+    parse_input(shard, client);
+}
+
+void drop_input(Shard *shard, ClientNode *client) {
+    client->rate.dropped++;
+    STAT_ADD(shard, throttle_drops, 1);
+    if (!client->rate.warned) {
+        client->rate.warned = 1;
+        send_reply(shard, client, "Warning: rate limit exceeded, messages dropped.\r\n");
+    }
+}
+
+/* Make room behind in->end for the next recv, compacting or growing the
+ * buffer as needed.
+ * Return: 0 on success and -1 on error
+ */
+int reserve_input(InBuf *in) {
+    if (in->data == NULL) {
+        in->data = pool_get(&input_pool);
+        if (!in->data) return -1;
+        in->cap = BUFFER_SIZE;
+    }
+    if (in->end < in->cap) return 0;
+
+    if (in->start > 0) {
+        memmove(in->data, in->data + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+        return 0;
+    }
+
+    // A single message fills the buffer; parse_input caps how far this goes
+    char *bigger;
+    if (in->cap == BUFFER_SIZE) {
+        // Out of the pool for good; only long messages need more
+        bigger = malloc(in->cap * 2);
+        if (bigger) {
+            memcpy(bigger, in->data, in->end);
+            pool_put(&input_pool, in->data);
+        }
+    } else {
+        bigger = realloc(in->data, in->cap * 2);
+    }
+    if (!bigger) {
+        perror("malloc");
+        return -1;
+    }
+    in->data = bigger;
+    in->cap *= 2;
+    return 0;
+}
+
+/* Handle every complete message in the client's input buffer, in place.
+ */
+void parse_input(Shard *shard, ClientNode *client) {
+    InBuf *in = &client->in;
+    while (!client->dead && !client->rate.paused && in->start < in->end) {
+        char *base = in->data + in->start;
+        size_t avail = in->end - in->start;
+
+        if (client->framing == FRAMING_LENGTH) {
+            if (avail < FRAME_HEADER_LEN) break;
+            uint32_t frame_len;
+            memcpy(&frame_len, base, FRAME_HEADER_LEN);
+            frame_len = ntohl(frame_len);
+            if (frame_len > MAX_FRAME_LEN) {
+                // No way to find the next frame boundary, so give up on it
+                send_reply(shard, client, "Error: frame too large\r\n");
+                flush_client(shard, client);
+                if (!client->dead) remove_client(shard, client);
+                return;
+            }
+            if (avail < FRAME_HEADER_LEN + frame_len) break;
+            if (!admit_input(shard, client, FRAME_HEADER_LEN + frame_len)) {
+                if (server_opts.throttle == THROTTLE_DELAY) {
+                    pause_input(shard, client);
+                    break;
+                }
+                in->start += FRAME_HEADER_LEN + frame_len;
+                drop_input(shard, client);
+                continue;
+            }
+
+            in->start += FRAME_HEADER_LEN + frame_len;
+            handle_message(shard, client, base + FRAME_HEADER_LEN, frame_len);
+            continue;
+        }
+
+        char *newline = memchr(base, '\n', avail);
+        if (newline == NULL) {
+            if (avail >= MAX_LINE_LEN && !in->discarding) {
+                send_reply(shard, client, "Warning: message too long and was dropped.\r\n");
+                in->discarding = 1;
+            }
+            if (in->discarding) {
+                in->start = in->end;
+            }
+            break;
+        }
+
+        size_t len = newline - base;
+        if (!in->discarding && !admit_input(shard, client, len + 1)) {
+            if (server_opts.throttle == THROTTLE_DELAY) {
+                pause_input(shard, client);
+                break;
+            }
+            in->start += len + 1;
+            drop_input(shard, client);
+            continue;
+        }
+        in->start += len + 1;
+        if (in->discarding) {
+            in->discarding = 0;
+            continue;
+        }
+        if (len > 0 && base[len - 1] == '\r') len--;
+        base[len] = '\0';
+        handle_message(shard, client, base, len);
+    }
+
+    if (!client->dead && in->start == in->end) {
+        in->start = in->end = 0;
+    }
+}
+
+void handle_client_input(Shard *shard, ClientNode *client) {
+    InBuf *in = &client->in;
+    if (reserve_input(in) < 0) {
+        remove_client(shard, client);
+        return;
+    }
+
+    ssize_t bytes_read = recv(client->socket, in->data + in->end, in->cap - in->end, 0);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+
+    if (bytes_read <= 0) {
+        remove_client(shard, client);
+        return;
+    }
+
+    in->end += bytes_read;
+    STAT_ADD(shard, bytes_in, bytes_read);
+    client->last_input = shard->now_ms;
+    client->pinged = 0;
+    parse_input(shard, client);
+}
+
+/* Copy received bytes that did not land in the input buffer (io_uring
+ * provided buffers) into it, parsing as it fills.
+ */
+void feed_input(Shard *shard, ClientNode *client, const char *data, size_t len) {
+    InBuf *in = &client->in;
+    while (len > 0 && !client->dead) {
+        if (reserve_input(in) < 0) {
+            remove_client(shard, client);
+            return;
+        }
+        size_t chunk = in->cap - in->end < len ? in->cap - in->end : len;
+        memcpy(in->data + in->end, data, chunk);
+        in->end += chunk;
+        data += chunk;
+        len -= chunk;
+        parse_input(shard, client);
+    }
+}
+
+/* Write a printable name for an accepted peer into host, which holds
+ * INET_ADDRSTRLEN bytes. Unix socket peers have no address worth showing.
+ */
+void peer_name(const struct sockaddr_storage *addr, char *host) {
+    if (addr->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr,
+                  host, INET_ADDRSTRLEN);
+    } else {
+        strcpy(host, "local");
+    }
+}
+
+/* Apply the per-connection socket options to an accepted socket.
+ */
+void tune_socket(int sock, int family) {
+    // Replies are small and already batched per wakeup; don't let Nagle hold them
+    int opt = 1;
+    if (family == AF_INET &&
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+    }
+    if (server_opts.sndbuf > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &server_opts.sndbuf, sizeof(int)) < 0) {
+        perror("setsockopt");
+    }
+    if (server_opts.rcvbuf > 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &server_opts.rcvbuf, sizeof(int)) < 0) {
+        perror("setsockopt");
+    }
+}
+
+/* Add (op EPOLL_CTL_ADD) or remove (EPOLL_CTL_DEL) a listener in the
+ * shard's epoll set. NULL tags the TCP listener and &unix_listen_fd the
+ * Unix one, which every shard shares and only one is woken for.
+ * Return: epoll_ctl's result
+ */
+int watch_listener(Shard *shard, int listen_fd, int op) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (listen_fd == unix_listen_fd) {
+        ev.events |= EPOLLEXCLUSIVE;
+        ev.data.ptr = &unix_listen_fd;
+    }
+    return epoll_ctl(shard->epoll_fd, op, listen_fd, &ev);
+}
+
+/* Get the spare descriptor back if shedding lost it, which happens when
+ * another thread takes the slot it freed.
+ */
+void restore_spare(Shard *shard) {
+    if (shard->spare_fd < 0) {
+        shard->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+}
+
+/* Out of descriptors: give up the spare one to take the oldest pending
+ * connection and close it straight away. Otherwise it would stay queued
+ * and keep the listener readable, spinning the loop.
+ * Return: 0 if a connection was shed and -1 if there was no spare or
+ * the freed slot went elsewhere
+ */
+int shed_connection(Shard *shard, int listen_fd) {
+    if (shard->spare_fd < 0) return -1;
+    close(shard->spare_fd);
+    int sock = accept(listen_fd, NULL, NULL);
+    if (sock >= 0) {
+        close(sock);
+        STAT_ADD(shard, shed, 1);
+    }
+    shard->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return sock >= 0 ? 0 : -1;
+}
+
+/* Nothing could be shed: stop taking connections on listen_fd for
+ * ACCEPT_RETRY_MS instead of waking for it over and over. On io_uring
+ * the accept has already ended, so not arming it again is enough.
+ */
+void pause_accept(Shard *shard, int listen_fd) {
+    int which = listen_fd == unix_listen_fd ? PAUSED_UNIX : PAUSED_TCP;
+    if (shard->accept_paused & which) return;
+    if (!shard->ring && watch_listener(shard, listen_fd, EPOLL_CTL_DEL) < 0) {
+        perror("epoll_ctl");
+        return;
+    }
+    shard->accept_paused |= which;
+    timer_schedule(&shard->timers, &shard->accept_timer, shard->now_ms + ACCEPT_RETRY_MS);
+}
+
+/* Watch the paused listeners again; if descriptors are still short the
+ * next accept pauses them once more.
+ */
+void resume_accept(Shard *shard) {
+    if ((shard->accept_paused & PAUSED_TCP) && shard->listen_fd >= 0) {
+        if (shard->ring) {
+            uring_arm_accept(shard, shard->listen_fd);
+        } else if (watch_listener(shard, shard->listen_fd, EPOLL_CTL_ADD) < 0) {
+            perror("epoll_ctl");
+        }
+    }
+    if (shard->accept_paused & PAUSED_UNIX) {
+        if (shard->ring) {
+            uring_arm_accept(shard, unix_listen_fd);
+        } else if (watch_listener(shard, unix_listen_fd, EPOLL_CTL_ADD) < 0) {
+            perror("epoll_ctl");
+        }
+    }
+    shard->accept_paused = 0;
+}
+
+/* Take every pending connection, up to ACCEPT_BATCH so a connection
+ * storm can't starve the clients already here; the listener stays
+ * readable and the rest come on the next pass.
+ */
+void accept_clients(Shard *shard, int listen_fd) {
+    restore_spare(shard);
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_storage client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        // Sends must never block the loop; slow readers queue instead
+        int new_socket = accept4(listen_fd, (struct sockaddr *)&client_addr,
+                                 &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (new_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EMFILE || errno == ENFILE) {
+                if (shed_connection(shard, listen_fd) < 0) pause_accept(shard, listen_fd);
+                return;
+            }
+            perror("accept");
+            return;
+        }
+
+        tune_socket(new_socket, client_addr.ss_family);
+        char client_host[INET_ADDRSTRLEN];
+        peer_name(&client_addr, client_host);
+
+        if (!add_client(shard, new_socket, client_host)) {
+            close(new_socket);
+            display_error("ERROR: ", "Failed to add client");
+        }
+    }
+}
+
+// ======== Timers ========
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Arm the client's timer for its next idle or heartbeat deadline, if
+ * either is enabled, or for the end of a rate limit pause if sooner.
+ */
+void schedule_client_timer(Shard *shard, ClientNode *client) {
+    uint64_t deadline = client->rate.paused ? client->rate.until : UINT64_MAX;
+    if (server_opts.idle_timeout > 0) {
+        uint64_t idle = client->last_input + 1000ULL * server_opts.idle_timeout;
+        if (idle < deadline) deadline = idle;
+    }
+    if (server_opts.heartbeat > 0 && !client->sender) {
+        // The ping goes out after one interval, the answer is due by two
+        uint64_t beat = client->last_input +
+                        1000ULL * server_opts.heartbeat * (client->pinged ? 2 : 1);
+        if (beat < deadline) deadline = beat;
+    }
+    if (deadline != UINT64_MAX) {
+        timer_schedule(&shard->timers, &client->timer, deadline);
+    }
+}
+
+/* Input only records when it arrived, so a busy client costs nothing
+ * here; its timer just finds it was active and goes back to sleep.
+ */
+void client_timer_fired(void *arg, Timer *timer) {
+    Shard *shard = arg;
+    ClientNode *client = (ClientNode *)((char *)timer - offsetof(ClientNode, timer));
+    if (client->rate.paused && shard->now_ms >= client->rate.until) {
+        resume_input(shard, client);
+        if (client->dead) return;
+    }
+    uint64_t silent = shard->now_ms - client->last_input;
+
+    int idle = server_opts.idle_timeout > 0 && silent >= 1000ULL * server_opts.idle_timeout;
+    int no_pong = client->pinged && silent >= 2000ULL * server_opts.heartbeat;
+    if (idle || no_pong) {
+        send_reply(shard, client, idle ? "Disconnected: idle\r\n" : "Disconnected: no heartbeat\r\n");
+        flush_client(shard, client);
+        if (!client->dead) remove_client(shard, client);
+        STAT_ADD(shard, timeouts, 1);
+        return;
+    }
+    if (server_opts.heartbeat > 0 && !client->pinged && !client->sender &&
+        silent >= 1000ULL * server_opts.heartbeat) {
+        client->pinged = 1;
+        send_reply(shard, client, PING_LINE);
+    }
+    schedule_client_timer(shard, client);
+}
+
+/* The wheel holds the clients' timers and the one that resumes accepting.
+ */
+void shard_timer_fired(void *arg, Timer *timer) {
+    Shard *shard = arg;
+    if (timer == &shard->accept_timer) {
+        resume_accept(shard);
+        return;
+    }
+    client_timer_fired(arg, timer);
+}
+
+/* Return: ms until the shard's next timer work, for epoll_wait, or -1
+ * to sleep until an event
+ */
+int next_timeout(Shard *shard) {
+    uint64_t next = timer_next_ms(&shard->timers);
+    if (next == UINT64_MAX) return -1;
+    uint64_t now = monotonic_ms();
+    if (next <= now) return 0;
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+// ======== io_uring Backend ========
+
+/* What a completion is for; stored in the low bits of user_data next to
+ * the ClientNode pointer (NULL for shard-wide operations).
+ */
+typedef enum UringOp {
+    URING_ACCEPT,
+    URING_INBOX,
+    URING_RECV,
+    URING_SEND,
+    URING_PROVIDE,
+    URING_TIMER,        // user_data carries timer_gen instead of a node
+    URING_ACCEPT_UNIX
+} UringOp;
+
+#define URING_OP_MASK 7
+
+static uint64_t uring_tag(ClientNode *client, UringOp op) {
+    return (uint64_t)(uintptr_t)client | op;
+}
+
+/* Return: a fresh sqe from the shard's ring, or NULL after reporting
+ */
+static struct io_uring_sqe *uring_sqe(Shard *shard) {
+    struct io_uring_sqe *sqe = uring_get_sqe(shard->ring);
+    if (!sqe) {
+        display_error("ERROR: ", "io_uring submission queue full");
+    }
+    return sqe;
+}
+
+/* Hand count provided buffers starting at bid back to the kernel.
+ */
+void uring_provide(Shard *shard, int bid, int count) {
+    struct io_uring_sqe *sqe = uring_sqe(shard);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(uintptr_t)(shard->recv_bufs + (size_t)bid * URING_BUF_SIZE);
+    sqe->len = URING_BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = uring_tag(NULL, URING_PROVIDE);
+}
+
+/* One multishot accept keeps producing a completion per connection.
+ */
+/* Every shard keeps a multishot accept on the shared Unix listener too;
+ * the kernel hands each connection to one of them.
+ */
+int uring_arm_accept(Shard *shard, int listen_fd) {
+    struct io_uring_sqe *sqe = uring_sqe(shard);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_tag(NULL, listen_fd == unix_listen_fd ? URING_ACCEPT_UNIX : URING_ACCEPT);
+    return 0;
+}
+
+/* Wake the ring at deadline_ms (CLOCK_MONOTONIC) for timer work.
+ */
+int uring_arm_timer(Shard *shard, uint64_t deadline_ms) {
+    struct io_uring_sqe *sqe = uring_sqe(shard);
+    if (!sqe) return -1;
+    shard->timer_ts.tv_sec = deadline_ms / 1000;
+    shard->timer_ts.tv_nsec = (deadline_ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&shard->timer_ts;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    shard->timer_gen++;
+    sqe->user_data = (shard->timer_gen << 3) | URING_TIMER;
+    shard->timer_armed = deadline_ms;
+    return 0;
+}
+
+int uring_arm_inbox(Shard *shard) {
+    struct io_uring_sqe *sqe = uring_sqe(shard);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = shard->inbox_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&shard->inbox_count;
+    sqe->len = sizeof(shard->inbox_count);
+    sqe->user_data = uring_tag(NULL, URING_INBOX);
+    return 0;
+}
+
+/* One recv per client at a time; the kernel picks a provided buffer for
+ * it. Re-arming only after the data is handled keeps a flooding client
+ * to one buffer per round, as the epoll loop does, instead of letting a
+ * multishot recv outrun the sends to everyone else.
+ * Return: 0 on success and -1 on error
+ */
+int uring_arm_recv(Shard *shard, ClientNode *client) {
+    struct io_uring_sqe *sqe = uring_sqe(shard);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->socket;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = uring_tag(client, URING_RECV);
+    client->inflight++;
+    return 0;
+}
+
+/* Start a chain of linked sendmsgs over the queue, MAX_IOV messages per
+ * link, unless one is already in flight; its completion starts the next.
+ * Return: 0 on success and -1 if the client was dropped
+ */
+int uring_flush_client(Shard *shard, ClientNode *client) {
+    OutQueue *queue = &client->out;
+    if (queue->in_flight > 0 || queue->len == 0) return 0;
+
+    if (client->send == NULL) {
+        client->send = pool_get(&uring_send_pool);
+        if (!client->send) {
+            remove_client(shard, client);
+            return -1;
+        }
+    }
+
+    UringSend *send = client->send;
+    int planned = (queue->len + MAX_IOV - 1) / MAX_IOV;
+    if (planned > URING_SEND_LINKS) planned = URING_SEND_LINKS;
+    // The chain must not be split across two submissions
+    if (uring_sq_space(shard->ring) < (unsigned)planned &&
+        uring_submit_and_wait(shard->ring, 0) < 0) {
+        return 0;
+    }
+
+    send->parts = send->done = send->broken = send->failed = 0;
+    send->sent = 0;
+    size_t queued = 0;
+    for (int part = 0; part < planned; part++) {
+        struct io_uring_sqe *sqe = uring_sqe(shard);
+        if (!sqe) break;
+
+        memset(&send->hdr[part], 0, sizeof(struct msghdr));
+        send->hdr[part].msg_iov = send->iov[part];
+        send->hdr[part].msg_iovlen = fill_iov(queue, queued, send->iov[part], &send->offered[part]);
+        queued += send->hdr[part].msg_iovlen;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = client->socket;
+        sqe->addr = (uint64_t)(uintptr_t)&send->hdr[part];
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = uring_tag(client, URING_SEND);
+        if (part + 1 < planned) {
+            // Keep the stream in order: the next part waits for this one
+            sqe->flags = IOSQE_IO_LINK;
+        }
+
+        send->parts++;
+        client->inflight++;
+        STAT_ADD(shard, write_calls, 1);
+    }
+    queue->in_flight = queued;
+    return 0;
+}
+
+void uring_accept_done(Shard *shard, int listen_fd, int res, unsigned flags) {
+    restore_spare(shard);
+    int more = flags & IORING_CQE_F_MORE;
+    if (res == -EMFILE || res == -ENFILE) {
+        if (shed_connection(shard, listen_fd) < 0 && !more) {
+            pause_accept(shard, listen_fd);
+            return;
+        }
+    } else if (res < 0) {
+        errno = -res;
+        perror("accept");
+    }
+    if (!more) {
+        uring_arm_accept(shard, listen_fd);
+    }
+    if (res < 0) return;
+
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    char client_host[INET_ADDRSTRLEN] = "";
+    if (getpeername(res, (struct sockaddr *)&client_addr, &addr_len) == 0) {
+        tune_socket(res, client_addr.ss_family);
+        peer_name(&client_addr, client_host);
+    }
+
+    if (!add_client(shard, res, client_host)) {
+        close(res);
+        display_error("ERROR: ", "Failed to add client");
+    }
+}
+
+void uring_recv_done(Shard *shard, ClientNode *client, int res, unsigned flags) {
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !client->dead) {
+            STAT_ADD(shard, bytes_in, res);
+            client->last_input = shard->now_ms;
+            client->pinged = 0;
+            feed_input(shard, client, shard->recv_bufs + (size_t)bid * URING_BUF_SIZE, res);
+        }
+        uring_provide(shard, bid, 1);
+    }
+
+    // EOF, an error, or the kernel ran out of provided buffers
+    client->inflight--;
+    if (client->dead) return;
+    if (client->rate.paused && (res == -ENOBUFS || res > 0)) {
+        // resume_input arms it again
+        client->rate.recv_stopped = 1;
+    } else if (res == -ENOBUFS || res > 0) {
+        uring_arm_recv(shard, client);
+    } else {
+        remove_client(shard, client);
+    }
+}
+
+void uring_send_done(Shard *shard, ClientNode *client, int res) {
+    UringSend *send = client->send;
+    int part = send->done++;
+    client->inflight--;
+
+    if (!send->broken) {
+        if (res < 0) {
+            send->broken = 1;
+            send->failed = res != -ECANCELED;
+        } else {
+            send->sent += res;
+            send->broken = (size_t)res < send->offered[part];
+        }
+    }
+    if (send->done < send->parts) return;
+
+    // The whole chain is back; retire what went out and send the rest
+    client->out.in_flight = 0;
+    if (client->dead) return;
+    if (send->failed) {
+        remove_client(shard, client);
+        return;
+    }
+    retire_sent(shard, &client->out, send->sent);
+    uring_flush_client(shard, client);
+}
+
+void run_shard_uring(Shard *shard) {
+    uring_provide(shard, 0, URING_BUF_COUNT);
+    if ((shard->listen_fd >= 0 && uring_arm_accept(shard, shard->listen_fd) < 0) ||
+        (unix_listen_fd >= 0 && uring_arm_accept(shard, unix_listen_fd) < 0) ||
+        uring_arm_inbox(shard) < 0) {
+        return;
+    }
+
+    while (1) {
+        // One timeout covers the earliest timer; a later one still in
+        // flight only means a spare wakeup
+        uint64_t next = timer_next_ms(&shard->timers);
+        if (next != UINT64_MAX && (shard->timer_armed == 0 || next < shard->timer_armed)) {
+            uring_arm_timer(shard, next);
+        }
+
+        // Submits everything queued last round, sleeping only if no
+        // completions are left over from it
+        unsigned wait_nr = uring_peek_cqe(shard->ring) ? 0 : 1;
+        if (uring_submit_and_wait(shard->ring, wait_nr) < 0) {
+            break;
+        }
+        shard->now_ms = monotonic_ms();
+
+        // Handle a bounded batch so queued sends go out between batches
+        struct io_uring_cqe *cqe;
+        for (int handled = 0; handled < MAX_EVENTS &&
+             (cqe = uring_peek_cqe(shard->ring)) != NULL; handled++) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(shard->ring);
+
+            ClientNode *client = (ClientNode *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+            switch (data & URING_OP_MASK) {
+            case URING_ACCEPT:
+                uring_accept_done(shard, shard->listen_fd, res, flags);
+                break;
+            case URING_ACCEPT_UNIX:
+                uring_accept_done(shard, unix_listen_fd, res, flags);
+                break;
+            case URING_INBOX:
+                uring_arm_inbox(shard);
+                deliver_inbox(shard);
+                break;
+            case URING_RECV:
+                uring_recv_done(shard, client, res, flags);
+                break;
+            case URING_SEND:
+                uring_send_done(shard, client, res);
+                break;
+            case URING_TIMER:
+                if ((data >> 3) == shard->timer_gen) shard->timer_armed = 0;
+                break;
+            default:
+                break;
+            }
+        }
+        timer_advance(&shard->timers, shard->now_ms, shard_timer_fired, shard);
+        flush_dirty(shard);
+        reap_clients(shard);
+    }
+}
+
+// ======== Event Loop ========
+
+void run_shard_epoll(Shard *shard) {
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // Only ready fds come back, so a wakeup costs O(ready) not O(clients);
+        // with no timer due the wait has no timeout at all
+        int ready = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, next_timeout(shard));
+
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        shard->now_ms = monotonic_ms();
+
+        for (int i = 0; i < ready; i++) {
+            void *source = events[i].data.ptr;
+            if (source == NULL) {
+                // Check for new connections
+                accept_clients(shard, shard->listen_fd);
+            } else if (source == &unix_listen_fd) {
+                accept_clients(shard, unix_listen_fd);
+            } else if (source == shard) {
+                // Broadcasts from other shards
+                drain_inbox(shard);
+            } else {
+                // Check client activity
+                ClientNode *client = source;
+                if (!client->dead && (events[i].events & EPOLLOUT)) {
+                    flush_client(shard, client);
+                }
+                if (!client->dead && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    handle_client_input(shard, client);
+                }
+            }
+        }
+        timer_advance(&shard->timers, shard->now_ms, shard_timer_fired, shard);
+        flush_dirty(shard);
+        reap_clients(shard);
+    }
+}
+
+void *run_shard(void *arg) {
+    Shard *shard = arg;
+
+    if (shard->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(shard->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            display_error("ERROR: Could not pin worker: ", strerror(err));
+        }
+    }
+
+    if (shard->ring) {
+        run_shard_uring(shard);
+    } else {
+        run_shard_epoll(shard);
+    }
+
+    cleanup_clients(shard);
+    free_rooms(shard);
+    return NULL;
+}
+
+/* Prereq: shard->listen_fd is a bound, listening socket, or -1 when the
+ * server only listens on unix_listen_fd.
+ * Return: 0 on success and -1 on error
+ */
+int init_shard(Shard *shard) {
+    shard->epoll_fd = -1;
+    shard->now_ms = monotonic_ms();
+    timer_wheel_init(&shard->timers, shard->now_ms);
+    shard->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    shard->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->inbox_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    pthread_mutex_init(&shard->inbox_lock, NULL);
+    shard->rooms = calloc(MAX_ROOMS, sizeof(RoomMembers));
+    if (!shard->rooms) {
+        perror("calloc");
+        return -1;
+    }
+
+    if (server_opts.backend == BACKEND_URING) {
+        shard->ring = malloc(sizeof(Uring));
+        shard->recv_bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+        if (!shard->ring || !shard->recv_bufs) {
+            perror("malloc");
+            return -1;
+        }
+        if (uring_init(shard->ring, URING_ENTRIES) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard->epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    if ((shard->listen_fd >= 0 && watch_listener(shard, shard->listen_fd, EPOLL_CTL_ADD) < 0) ||
+        (unix_listen_fd >= 0 && watch_listener(shard, unix_listen_fd, EPOLL_CTL_ADD) < 0)) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    // The shard itself tags its inbox
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = shard;
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->inbox_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static void leave_federation() {
+    if (fed_bus) {
+        bus_close(fed_bus);
+    }
+    fed_bus = NULL;
+}
+
+static void close_log() {
+    if (msg_log) {
+        msglog_close(msg_log);
+    }
+    msg_log = NULL;
+}
+
+/* Set up the allocator pools, filled as far as the options ask.
+ * Return: 0 on success and -1 on error
+ */
+static int init_pools() {
+    int err = 0;
+    for (int i = 0; i < MSG_CLASSES; i++) {
+        err |= pool_init(&msg_pools[i], (size_t)MSG_CLASS_MIN << i);
+    }
+    err |= pool_init(&client_pool, sizeof(ClientNode));
+    err |= pool_init(&input_pool, BUFFER_SIZE);
+    err |= pool_init(&queue_pool, (size_t)server_opts.queue_limit * sizeof(MsgBuf *));
+    err |= pool_init(&uring_send_pool, sizeof(UringSend));
+    if (err) return -1;
+
+    size_t clients = (size_t)server_opts.reserve_clients;
+    for (int i = 0; i < MSG_CLASSES && (MSG_CLASS_MIN << i) <= MSG_RESERVE_MAX; i++) {
+        err |= pool_reserve(&msg_pools[i], (size_t)server_opts.reserve_msgs);
+    }
+    err |= pool_reserve(&client_pool, clients);
+    err |= pool_reserve(&input_pool, clients);
+    err |= pool_reserve(&queue_pool, clients);
+    if (server_opts.backend == BACKEND_URING) {
+        err |= pool_reserve(&uring_send_pool, clients);
+    }
+    return err ? -1 : 0;
+}
+
+void run_server() {
+    if (msg_log && msglog_start(msg_log) < 0) {
+        exit(1);
+    }
+    if (init_pools() < 0) {
+        exit(1);
+    }
+    if (server_opts.history > 0) {
+        size_t index_mem = server_opts.index_mem ? server_opts.index_mem : 4 * server_opts.history;
+        history = history_new(server_opts.history, index_mem);
+        if (!history) {
+            exit(1);
+        }
+    }
+    rooms = calloc(MAX_ROOMS, sizeof(Room));
+    if (!rooms) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (init_shard(&shards[i]) < 0) {
+            exit(1);
+        }
+    }
+    if (fed_bus) {
+        bus_reader.stats = &stats_slots[shard_count].stats;
+        if (bus_cursor_init(fed_bus, &bus_reader.cursor) < 0) {
+            exit(1);
+        }
+        int err = pthread_create(&bus_reader.thread, NULL, run_bus_reader, &bus_reader);
+        if (err != 0) {
+            display_error("ERROR: Could not start bus reader: ", strerror(err));
+            exit(1);
+        }
+    }
+
+    if (follow_fd >= 0) {
+        pthread_t follower;
+        int err = pthread_create(&follower, NULL, run_follower, NULL);
+        if (err != 0) {
+            display_error("ERROR: Could not start follower: ", strerror(err));
+            exit(1);
+        }
+        pthread_detach(follower);
+    }
+    if (ship_listen_fd >= 0 && start_shipper() < 0) {
+        exit(1);
+    }
+
+    // Shard 0 runs on this thread, the rest get their own
+    for (int i = 1; i < shard_count; i++) {
+        int err = pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]);
+        if (err != 0) {
+            display_error("ERROR: Could not start worker: ", strerror(err));
+            exit(1);
+        }
+    }
+    run_shard(&shards[0]);
+
+    for (int i = 0; i < shard_count; i++) {
+        if (shards[i].ring) {
+            uring_exit(shards[i].ring);
+            free(shards[i].ring);
+            free(shards[i].recv_bufs);
+        } else {
+            close(shards[i].epoll_fd);
+        }
+        close(shards[i].inbox_fd);
+        if (shards[i].listen_fd >= 0) {
+            close(shards[i].listen_fd);
+        }
+        if (shards[i].spare_fd >= 0) {
+            close(shards[i].spare_fd);
+        }
+    }
+    if (unix_listen_fd >= 0) {
+        close(unix_listen_fd);
+    }
+    for (int i = 0; i < room_count; i++) {
+        free(rooms[i].shard_members);
+    }
+    free(rooms);
+    close_log();
+    exit(0);
+}
+
+// ======== Command Handlers ========
+
+void server_options_default(ServerOptions *opts) {
+    opts->workers = 1;
+    opts->pin_cpus = 0;
+    opts->queue_limit = 256;
+    opts->slow_policy = SLOW_DROP_OLDEST;
+    opts->backend = BACKEND_EPOLL;
+    opts->log_dir[0] = '\0';
+    opts->log_keep = 0;
+    opts->replay = 0;
+    opts->sndbuf = 0;
+    opts->rcvbuf = 0;
+    opts->idle_timeout = 0;
+    opts->heartbeat = 0;
+    opts->rate_msgs = 0;
+    opts->rate_bytes = 0;
+    opts->throttle = THROTTLE_DELAY;
+    opts->reserve_clients = 0;
+    opts->reserve_msgs = 0;
+    opts->history = 0;
+    opts->index_mem = 0;
+    opts->unix_path[0] = '\0';
+    opts->federation[0] = '\0';
+    opts->ship[0] = '\0';
+    opts->standby[0] = '\0';
+    opts->echo = 1;
+}
+
+int parse_server_options(char **tokens, ServerOptions *opts) {
+    char *endptr;
+    ssize_t index = 0;
+    while (tokens[index] != NULL) {
+        if (strcmp(tokens[index], "--workers") == 0) {
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing worker count", "start-server --workers");
+                return -1;
+            }
+            opts->workers = strtol(tokens[index], &endptr, 10);
+            if (*endptr != '\0' || opts->workers < 1) {
+                display_error("ERROR: Invalid worker count", tokens[index]);
+                return -1;
+            }
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--pin") == 0) {
+            opts->pin_cpus = 1;
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--echo") == 0) {
+            opts->echo = 1;
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--queue-limit") == 0) {
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing queue limit", "start-server --queue-limit");
+                return -1;
+            }
+            opts->queue_limit = strtol(tokens[index], &endptr, 10);
+            if (*endptr != '\0' || opts->queue_limit < 1) {
+                display_error("ERROR: Invalid queue limit", tokens[index]);
+                return -1;
+            }
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--backend") == 0) {
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing backend", "start-server --backend");
+                return -1;
+            }
+            if (strcmp(tokens[index], "epoll") == 0) {
+                opts->backend = BACKEND_EPOLL;
+            } else if (strcmp(tokens[index], "io_uring") == 0) {
+                opts->backend = BACKEND_URING;
+            } else {
+                display_error("ERROR: Invalid backend", tokens[index]);
+                return -1;
+            }
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--log-dir") == 0) {
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing log directory", "start-server --log-dir");
+                return -1;
+            }
+            if (strlen(tokens[index]) >= sizeof(opts->log_dir)) {
+                display_error("ERROR: Log directory too long", tokens[index]);
+                return -1;
+            }
+            strcpy(opts->log_dir, tokens[index]);
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--log-keep") == 0) {
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing segment count", "start-server --log-keep");
+                return -1;
+            }
+            opts->log_keep = strtol(tokens[index], &endptr, 10);
+            if (*endptr != '\0' || opts->log_keep < 1) {
+                display_error("ERROR: Invalid segment count", tokens[index]);
+                return -1;
+            }
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--unix") == 0 || strcmp(tokens[index], "--ship") == 0 ||
+            strcmp(tokens[index], "--standby") == 0) {
+            char *path = strcmp(tokens[index], "--unix") == 0 ? opts->unix_path
+                : strcmp(tokens[index], "--ship") == 0 ? opts->ship : opts->standby;
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing socket path for ", tokens[index - 1]);
+                return -1;
+            }
+            if (strlen(tokens[index]) >= UNIX_PATH_LEN) {
+                display_error("ERROR: Socket path too long", tokens[index]);
+                return -1;
+            }
+            strcpy(path, tokens[index]);
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--federate") == 0) {
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing bus name", "start-server --federate");
+                return -1;
+            }
+            // The name becomes part of a shared memory object name
+            size_t name_len = strspn(tokens[index],
+                "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-");
+            if (name_len == 0 || tokens[index][name_len] != '\0' ||
+                name_len >= sizeof(opts->federation)) {
+                display_error("ERROR: Invalid bus name", tokens[index]);
+                return -1;
+            }
+            strcpy(opts->federation, tokens[index]);
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--replay") == 0) {
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing replay count", "start-server --replay");
+                return -1;
+            }
+            opts->replay = strtol(tokens[index], &endptr, 10);
+            if (*endptr != '\0' || opts->replay < 0) {
+                display_error("ERROR: Invalid replay count", tokens[index]);
+                return -1;
+            }
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--sndbuf") == 0 ||
+            strcmp(tokens[index], "--rcvbuf") == 0) {
+            int *size = tokens[index][2] == 's' ? &opts->sndbuf : &opts->rcvbuf;
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing buffer size", tokens[index - 1]);
+                return -1;
+            }
+            long value = strtol(tokens[index], &endptr, 10);
+            if (*endptr != '\0' || value < 1 || value > INT_MAX) {
+                display_error("ERROR: Invalid buffer size", tokens[index]);
+                return -1;
+            }
+            *size = (int)value;
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--idle-timeout") == 0 ||
+            strcmp(tokens[index], "--heartbeat") == 0) {
+            int *secs = tokens[index][2] == 'i' ? &opts->idle_timeout : &opts->heartbeat;
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing seconds", tokens[index - 1]);
+                return -1;
+            }
+            long value = strtol(tokens[index], &endptr, 10);
+            if (*endptr != '\0' || value < 0 || value > 86400) {
+                display_error("ERROR: Invalid seconds", tokens[index]);
+                return -1;
+            }
+            *secs = (int)value;
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--rate-msgs") == 0 ||
+            strcmp(tokens[index], "--rate-bytes") == 0) {
+            int *rate = tokens[index][7] == 'm' ? &opts->rate_msgs : &opts->rate_bytes;
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing rate", tokens[index - 1]);
+                return -1;
+            }
+            long value = strtol(tokens[index], &endptr, 10);
+            if (*endptr != '\0' || value < 0 || value > INT_MAX) {
+                display_error("ERROR: Invalid rate", tokens[index]);
+                return -1;
+            }
+            *rate = (int)value;
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--reserve-clients") == 0 ||
+            strcmp(tokens[index], "--reserve-msgs") == 0) {
+            int *count = tokens[index][10] == 'c' ? &opts->reserve_clients : &opts->reserve_msgs;
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing count", tokens[index - 1]);
+                return -1;
+            }
+            long value = strtol(tokens[index], &endptr, 10);
+            if (*endptr != '\0' || value < 0 || value > INT_MAX) {
+                display_error("ERROR: Invalid count", tokens[index]);
+                return -1;
+            }
+            *count = (int)value;
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--history") == 0 ||
+            strcmp(tokens[index], "--index-mem") == 0) {
+            size_t *bytes = tokens[index][2] == 'h' ? &opts->history : &opts->index_mem;
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing byte count", tokens[index - 1]);
+                return -1;
+            }
+            long long value = strtoll(tokens[index], &endptr, 10);
+            if (*endptr != '\0' || value < 0 || value > UINT32_MAX) {
+                display_error("ERROR: Invalid byte count", tokens[index]);
+                return -1;
+            }
+            *bytes = (size_t)value;
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--throttle") == 0) {
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing throttle policy", "start-server --throttle");
+                return -1;
+            }
+            if (strcmp(tokens[index], "delay") == 0) {
+                opts->throttle = THROTTLE_DELAY;
+            } else if (strcmp(tokens[index], "drop") == 0) {
+                opts->throttle = THROTTLE_DROP;
+            } else {
+                display_error("ERROR: Invalid throttle policy", tokens[index]);
+                return -1;
+            }
+            index++;
+            continue;
+        }
+        if (strcmp(tokens[index], "--slow-policy") == 0) {
+            index++;
+            if (tokens[index] == NULL) {
+                display_error("ERROR: Missing policy", "start-server --slow-policy");
+                return -1;
+            }
+            if (strcmp(tokens[index], "drop-oldest") == 0) {
+                opts->slow_policy = SLOW_DROP_OLDEST;
+            } else if (strcmp(tokens[index], "drop-newest") == 0) {
+                opts->slow_policy = SLOW_DROP_NEWEST;
+            } else if (strcmp(tokens[index], "disconnect") == 0) {
+                opts->slow_policy = SLOW_DISCONNECT;
+            } else {
+                display_error("ERROR: Invalid policy", tokens[index]);
+                return -1;
+            }
+            index++;
+            continue;
+        }
+        display_error("ERROR: Unknown option ", tokens[index]);
+        return -1;
+    }
+    return 0;
+}
+
+/* Return: a listening socket on port, or -1 on error, reported unless
+ * report is unset and the port was taken
+ */
+static int open_listener(int port, int reuse_port, int report) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Set socket options
+    int opt = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+                  &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        close(sock);
+        return -1;
+    }
+    // Every worker binds the same port; the kernel spreads connections
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                                 &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        close(sock);
+        return -1;
+    }
+
+    // Bind socket
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (report) display_error("ERROR: ", "Address already in use");
+        close(sock);
+        return -1;
+    }
+
+    // Listen
+    if (listen(sock, SOMAXCONN) < 0) {
+        perror("listen");
+        close(sock);
+        return -1;
+    }
+
+    // Make socket non-blocking
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    return sock;
+}
+
+/* A socket file is left behind by a server that died without cleaning
+ * up. Return: 1 if nothing accepts connections on addr any more
+ */
+static int stale_socket(const struct sockaddr_un *addr) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return 0;
+    int stale = connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+                errno == ECONNREFUSED;
+    close(sock);
+    return stale;
+}
+
+/* Return: a listening AF_UNIX socket at path, or -1 on error
+ */
+static int open_unix_listener(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        display_error("ERROR: Socket path too long: ", (char *)path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    if (bound < 0 && errno == EADDRINUSE && stale_socket(&addr)) {
+        unlink(path);
+        bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (bound < 0) {
+        display_error("ERROR: Could not bind socket path: ", (char *)path);
+        close(sock);
+        return -1;
+    }
+    if (listen(sock, SOMAXCONN) < 0) {
+        perror("listen");
+        close(sock);
+        unlink(path);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    return sock;
+}
 
-            char client_host[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client_addr.sin_addr, 
-                     client_host, INET_ADDRSTRLEN);
-            
-            if (!add_client(new_socket, client_host)) {
-                close(new_socket);
-                display_error("ERROR: ", "Failed to add client");
-            }
-        }
+/* Map the counters shared with the shell, one zeroed slot per worker and
+ * one after them for the bus reader.
+ * Return: 0 on success and -1 on error
+ */
+static int map_stats(int workers) {
+    void *region = mmap(NULL, (workers + 1) * sizeof(StatsSlot), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    stats_slots = region;
+    stats_count = workers + 1;
+    clock_gettime(CLOCK_MONOTONIC, &stats_started);
+    return 0;
+}
 
-        // Check client activity
-        current = clients;
-        while (current) {
-            if (FD_ISSET(current->socket, &read_fds)) {
-                char buffer[BUFFER_SIZE] = {0};
-                int bytes_read = recv(current->socket, buffer, BUFFER_SIZE, 0);
-                if (bytes_read == BUFFER_SIZE) {
-                    send(current->socket, "Warning: message too long and may be truncated.\n", 48, 0);
-                }
-                
-                if (bytes_read <= 0) {
-                    ClientNode *temp = current;
-                    current = current->next;
-                    remove_client(temp->socket);
-                    continue;
-                }
+static void unmap_stats() {
+    if (stats_slots) {
+        munmap(stats_slots, stats_count * sizeof(StatsSlot));
+    }
+    stats_slots = NULL;
+    stats_count = 0;
+}
 
-                // Handle special commands
-                if (strncmp(buffer, "\\connected", 10) == 0) {
-                    char msg[BUFFER_SIZE];
-                    snprintf(msg, sizeof(msg), 
-                            "Client %d: %d clients connected",
-                            current->id, client_counter);
-                    send(current->socket, msg, strlen(msg), 0);
-                    current = current->next;
-                    continue;
-                }
+int server_stats(ServerStats *total, double *uptime) {
+    memset(total, 0, sizeof(ServerStats));
+    *uptime = 0;
+    if (!stats_slots) return -1;
 
-                // Broadcast regular message
-                char msg[BUFFER_SIZE + 20];
-                snprintf(msg, sizeof(msg), "client %d: %s", 
-                         current->id, buffer);
-                broadcast_message(msg);
-            }
-            current = current->next;
+    // Each slot is an array of words; sum them field by field
+    unsigned long *sum = (unsigned long *)total;
+    for (int i = 0; i < stats_count; i++) {
+        unsigned long *slot = (unsigned long *)&stats_slots[i].stats;
+        for (size_t j = 0; j < sizeof(ServerStats) / sizeof(unsigned long); j++) {
+            sum[j] += __atomic_load_n(&slot[j], __ATOMIC_RELAXED);
         }
     }
 
-    cleanup_clients();
-    close(server_socket);
-    exit(0);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *uptime = (now.tv_sec - stats_started.tv_sec) +
+              (now.tv_nsec - stats_started.tv_nsec) / 1e9;
+    return stats_count - 1;
 }
 
-// ======== Command Handlers ========
+static void free_shards() {
+    for (int i = 0; i < shard_count; i++) {
+        if (shards[i].listen_fd >= 0) {
+            close(shards[i].listen_fd);
+        }
+    }
+    if (unix_listen_fd >= 0) {
+        close(unix_listen_fd);
+        unix_listen_fd = -1;
+    }
+    if (ship_listen_fd >= 0) {
+        close(ship_listen_fd);
+        ship_listen_fd = -1;
+    }
+    if (follow_fd >= 0) {
+        close(follow_fd);
+        follow_fd = -1;
+    }
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+}
 
-ssize_t start_server(int port) {
-    server_running = 1;
-    if (server_pid != -1) {
-        display_error("ERROR: ", "Server already running");
+ssize_t open_server(int port, const ServerOptions *opts) {
+    if (opts->workers < 1) {
+        display_error("ERROR: ", "Invalid worker count");
         return -1;
     }
-
-    // Create socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("socket");
+    if (opts->queue_limit < 1) {
+        display_error("ERROR: ", "Invalid queue limit");
+        return -1;
+    }
+    if (port < 0 || port > 65535 || (port == 0 && opts->unix_path[0] == '\0')) {
+        display_error("ERROR: ", "Invalid port number");
+        return -1;
+    }
+    int standby = opts->standby[0] != '\0';
+    if (standby && (port == 0 || opts->history == 0)) {
+        display_error("ERROR: ", "A standby needs a port and --history");
         return -1;
     }
+    if (standby && (opts->log_dir[0] != '\0' || opts->federation[0] != '\0' ||
+                    opts->ship[0] != '\0')) {
+        display_error("ERROR: ", "A standby cannot use --log-dir, --federate or --ship");
+        return -1;
+    }
+    server_opts = *opts;
+    if (server_opts.backend == BACKEND_URING && !uring_supported()) {
+        display_error("WARNING: ", "io_uring not supported here, using epoll");
+        server_opts.backend = BACKEND_EPOLL;
+    }
 
-    // Set socket options
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, 
-                  &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
-        close(server_socket);
+    unmap_stats();
+    if (map_stats(opts->workers) < 0) {
+        return -1;
+    }
+    shards = calloc(opts->workers, sizeof(Shard));
+    if (!shards) {
+        perror("calloc");
+        unmap_stats();
         return -1;
     }
+    shard_count = opts->workers;
 
-    // Bind socket
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < shard_count; i++) {
+        shards[i].index = i;
+        shards[i].cpu = (opts->pin_cpus && cpus > 0) ? (int)(i % cpus) : -1;
+        shards[i].listen_fd = -1;
+        shards[i].stats = &stats_slots[i].stats;
+    }
+    // A standby binds the port once its primary is gone
+    for (int i = 0; port > 0 && !standby && i < shard_count; i++) {
+        shards[i].listen_fd = open_listener(port, shard_count > 1, 1);
+        if (shards[i].listen_fd < 0) {
+            free_shards();
+            unmap_stats();
+            return -1;
+        }
+    }
+    // Recover the log here so a bad directory is reported to the shell
+    if (server_opts.log_dir[0] != '\0') {
+        msg_log = msglog_open(server_opts.log_dir, (size_t)server_opts.log_keep);
+        if (!msg_log) {
+            display_error("ERROR: Could not open message log: ", server_opts.log_dir);
+            free_shards();
+            unmap_stats();
+            return -1;
+        }
+    }
 
-    if (bind(server_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        display_error("ERROR: ", "Address already in use");
-        close(server_socket);
-        return -1;
+    if (server_opts.federation[0] != '\0') {
+        fed_bus = bus_open(server_opts.federation);
+        if (!fed_bus) {
+            display_error("ERROR: Could not join federation: ", server_opts.federation);
+            free_shards();
+            unmap_stats();
+            close_log();
+            return -1;
+        }
+    }
+    if (standby) {
+        follow_fd = connect_unix(server_opts.standby);
+        if (follow_fd < 0) {
+            display_error("ERROR: Could not reach the primary at ", server_opts.standby);
+            free_shards();
+            unmap_stats();
+            return -1;
+        }
+        standby_port = port;
+    }
+    // Last, since a bound socket path has to be removed again on failure
+    if (server_opts.unix_path[0] != '\0') {
+        unix_listen_fd = open_unix_listener(server_opts.unix_path);
+        if (unix_listen_fd < 0) {
+            free_shards();
+            unmap_stats();
+            close_log();
+            leave_federation();
+            return -1;
+        }
+    }
+    if (server_opts.ship[0] != '\0') {
+        ship_listen_fd = open_unix_listener(server_opts.ship);
+        if (ship_listen_fd < 0) {
+            if (unix_listen_fd >= 0) unlink(server_opts.unix_path);
+            free_shards();
+            unmap_stats();
+            close_log();
+            leave_federation();
+            return -1;
+        }
     }
+    return 0;
+}
 
-    // Listen
-    if (listen(server_socket, SOMAXCONN) < 0) {
-        perror("listen");
-        close(server_socket);
+ssize_t start_server(int port, const ServerOptions *opts) {
+    server_running = 1;
+    if (server_pid != -1) {
+        display_error("ERROR: ", "Server already running");
+        return -1;
+    }
+    if (open_server(port, opts) < 0) {
         return -1;
     }
-
-    // Make socket non-blocking
-    fcntl(server_socket, F_SETFL, O_NONBLOCK);
 
     // Fork server process
     server_pid = fork();
     if (server_pid < 0) {
         perror("fork");
-        close(server_socket);
+        if (unix_listen_fd >= 0) unlink(server_opts.unix_path);
+        if (ship_listen_fd >= 0) unlink(server_opts.ship);
+        free_shards();
+        unmap_stats();
+        close_log();
+        leave_federation();
         return -1;
     }
 
     if (server_pid == 0) {
         // Child process (server)
+        close_send_pool();
         run_server();
     }
 
+    // The listening sockets and the log belong to the server process now
+    free_shards();
+    close_log();
+    server_port = port;
     return 0;
 }
 
+/* Wait for a signal to stop on, which every other thread blocks, and
+ * leave nothing behind that the next server would trip over.
+ */
+static void *run_signal_waiter(void *arg) {
+    sigset_t *stop = arg;
+    int sig;
+    sigwait(stop, &sig);
+    if (unix_listen_fd >= 0) {
+        unlink(server_opts.unix_path);
+    }
+    // A standby that took over ships at its primary's path
+    if (ship_listen_fd >= 0) {
+        unlink(server_opts.ship[0] != '\0' ? server_opts.ship : server_opts.standby);
+    }
+    leave_federation();
+    _exit(0);
+    return NULL;
+}
+
+void serve() {
+    static sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t waiter;
+    int err = pthread_create(&waiter, NULL, run_signal_waiter, &stop);
+    if (err != 0) {
+        display_error("ERROR: Could not start signal waiter: ", strerror(err));
+        exit(1);
+    }
+    run_server();
+}
+
 ssize_t close_server() {
     if (server_pid == -1) {
         display_error("ERROR: ", "No server running");
@@ -263,166 +3637,554 @@ ssize_t close_server() {
 
     server_pid = -1;
     server_port = -1;
-    cleanup_clients();
-    close(server_socket);
+    if (server_opts.unix_path[0] != '\0') {
+        unlink(server_opts.unix_path);
+    }
+    // A standby that took over ships from its primary's path, which is
+    // only ours to remove once nothing listens there
+    const char *ship_path = server_opts.ship[0] != '\0' ? server_opts.ship : server_opts.standby;
+    if (ship_path[0] != '\0' && !path_in_use(ship_path)) {
+        unlink(ship_path);
+    }
+    // The shell holds the membership, so a crashed server still leaves
+    leave_federation();
+    unmap_stats();
     display_message("Server stopped\n");
     server_running = 0;
 
     return 0;
 }
 
-// ... (send_message and start_client functions remain the same as previous version)
-ssize_t bn_send_msg(char **tokens) {
-    if (tokens[1] == NULL) {
-        display_error("ERROR: ", "No port provided");
-        return -1;
+/* Close every pooled send connection.
+ */
+void close_send_pool() {
+    for (int i = 0; i < SEND_POOL_SIZE; i++) {
+        if (send_pool[i].last_used != 0) {
+            close(send_pool[i].fd);
+        }
+        send_pool[i].last_used = 0;
     }
+}
 
-    if (tokens[2] == NULL) {
-        display_error("ERROR: ", "No hostname provided");
+/* A pooled connection announced itself with SENDER_LINE, so the server
+ * sends it no broadcasts; throw away any replies it did get, such as
+ * errors, and notice if the server hung up.
+ * Return: 0 if the connection is still open and -1 if not
+ */
+static int drain_pooled(int fd) {
+    char discard[BUFFER_SIZE];
+    while (1) {
+        ssize_t n = recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
         return -1;
     }
+}
 
-    if (tokens[3] == NULL) {
-        display_error("ERROR: ", "No message provided");
+/* Return: a connected socket to the AF_UNIX socket at path, or -1 on error
+ */
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        display_error("ERROR: Socket path too long: ", (char *)path);
         return -1;
     }
+    strcpy(addr.sun_path, path);
 
-    char *endptr;
-    long port = strtol(tokens[1], &endptr, 10);
-    if (*endptr != '\0' || port <= 0 || port > 65535) {
-        display_error("ERROR: ", "Invalid port number");
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        perror("socket");
         return -1;
     }
-    char msg_buf[MAX_USER_MSG + 3] = "";
-    for (int i = 3; tokens[i] != NULL; i++) {
-        if (strlen(msg_buf) + strlen(tokens[i]) + 2 >= MAX_USER_MSG) {
-            display_error("ERROR: ", "Message too long");
-            return -1;
-        }
-        strcat(msg_buf, tokens[i]);
-        if (tokens[i + 1] != NULL) strcat(msg_buf, " ");
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock_fd);
+        return -1;
     }
-    strcat(msg_buf, "\r\n");
+    return sock_fd;
+}
 
-    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd < 0) {
-        perror("socket");
-        return -1;
+/* Return: a connected socket to host:port, or to the socket path of a
+ * UNIX_PREFIX host, or -1 on error
+ */
+static int connect_to(const char *host, int port) {
+    if (strncmp(host, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+        return connect_unix(host + strlen(UNIX_PREFIX));
     }
 
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons((uint16_t)port);
-    if (inet_pton(AF_INET, tokens[2], &server_addr.sin_addr) <= 0) {
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
         display_error("ERROR: ", "Invalid hostname or IP");
-        close(sock_fd);
         return -1;
     }
 
+    int sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        perror("socket");
+        return -1;
+    }
     if (connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("connect");
         close(sock_fd);
         return -1;
     }
+    return sock_fd;
+}
 
-    if (send(sock_fd, msg_buf, strlen(msg_buf), 0) == -1) {
-        display_error("ERROR: ", "Failed to send message");
-        close(sock_fd);
-        return -1;
+/* Write all len bytes to a blocking socket.
+ * Return: 0 on success and -1 on error
+ */
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Return: the pool entry for host:port, connected, or NULL on error.
+ * A new connection replaces the least recently used entry if the pool
+ * is full.
+ */
+static SendConn *pooled_connection(const char *host, int port) {
+    SendConn *slot = &send_pool[0];
+    for (int i = 0; i < SEND_POOL_SIZE; i++) {
+        SendConn *conn = &send_pool[i];
+        if (conn->last_used != 0 && conn->port == port && strcmp(conn->host, host) == 0) {
+            if (drain_pooled(conn->fd) == 0) {
+                conn->last_used = ++send_clock;
+                return conn;
+            }
+            // The server dropped it; reconnect in place
+            close(conn->fd);
+            conn->last_used = 0;
+            slot = conn;
+            break;
+        }
+        if (conn->last_used < slot->last_used) slot = conn;
     }
 
-    close(sock_fd);
+    int fd = connect_to(host, port);
+    if (fd < 0) return NULL;
+    if (send_all(fd, SENDER_LINE, strlen(SENDER_LINE)) < 0) {
+        perror("send");
+        close(fd);
+        return NULL;
+    }
+    if (slot->last_used != 0) {
+        close(slot->fd);
+    }
+    strcpy(slot->host, host);
+    slot->port = port;
+    slot->fd = fd;
+    slot->last_used = ++send_clock;
+    return slot;
+}
+
+/* Write all len bytes to fd.
+ * Return: 0 on success and -1 on error
+ */
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
     return 0;
 }
 
-ssize_t start_client(int port, const char *hostname) {
-    if (port <= 0 || port > 65535) {
-        display_error("ERROR: ", "Invalid port number");
+/* Write out the coalesced lines of a stream, first discarding what the
+ * server sent back.
+ * Return: 0 on success and -1 on error
+ */
+static int flush_stream(SendConn *conn, const char *out, size_t *out_len, unsigned long *bytes) {
+    if (drain_pooled(conn->fd) < 0 || send_all(conn->fd, out, *out_len) < 0) {
+        display_error("ERROR: ", "Failed to send message");
         return -1;
     }
+    *bytes += *out_len;
+    *out_len = 0;
+    return 0;
+}
 
-    if (hostname == NULL || strlen(hostname) == 0) {
-        display_error("ERROR: ", "Invalid hostname");
+/* Send every line read from in_fd as its own message over one pooled
+ * connection, coalescing up to STREAM_BATCH bytes of them per write,
+ * then report the rate. Empty lines are skipped, as are lines longer
+ * than the server accepts.
+ * Return: 0 on success and -1 on error
+ */
+static int send_stream(const char *host, int port, int in_fd) {
+    SendConn *conn = pooled_connection(host, port);
+    if (!conn) return -1;
+
+    char *in = malloc(MAX_LINE_LEN + STREAM_CHUNK);
+    // Flushed once it reaches STREAM_BATCH, so one more line always fits
+    char *out = malloc(STREAM_BATCH + MAX_LINE_LEN);
+    if (!in || !out) {
+        perror("malloc");
+        free(in);
+        free(out);
         return -1;
     }
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        display_error("ERROR: ", "socket failed");
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long sent = 0, skipped = 0, bytes = 0;
+    size_t in_len = 0, out_len = 0;
+    int overlong = 0;   // inside a line that is being skipped
+    int eof = 0, err = 0;
+    while (!eof && !err) {
+        ssize_t n = read(in_fd, in + in_len, STREAM_CHUNK);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            err = 1;
+            break;
+        }
+        if (n == 0) {
+            eof = 1;
+            // A last line without a newline still counts
+            if (in_len > 0) in[in_len++] = '\n';
+        }
+        in_len += (size_t)n;
+
+        size_t start_at = 0;
+        for (char *nl; (nl = memchr(in + start_at, '\n', in_len - start_at)) != NULL; ) {
+            size_t line_len = (size_t)(nl - (in + start_at));
+            if (line_len > 0 && in[start_at + line_len - 1] == '\r') line_len--;
+            if (overlong || line_len + 2 > MAX_LINE_LEN) {
+                skipped++;
+            } else if (line_len > 0) {
+                memcpy(out + out_len, in + start_at, line_len);
+                memcpy(out + out_len + line_len, "\r\n", 2);
+                out_len += line_len + 2;
+                sent++;
+            }
+            overlong = 0;
+            start_at = (size_t)(nl - in) + 1;
+            if (out_len >= STREAM_BATCH && flush_stream(conn, out, &out_len, &bytes) < 0) {
+                err = 1;
+                break;
+            }
+        }
+        memmove(in, in + start_at, in_len - start_at);
+        in_len -= start_at;
+        if (in_len > MAX_LINE_LEN) {
+            // No newline in sight; drop what we have of this line
+            overlong = 1;
+            in_len = 0;
+        }
+
+        if (!err && eof && out_len > 0 && flush_stream(conn, out, &out_len, &bytes) < 0) {
+            err = 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(in);
+    free(out);
+    if (err) {
+        // The server may have taken part of the stream; start afresh next time
+        close(conn->fd);
+        conn->last_used = 0;
         return -1;
     }
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    
-    if (inet_pton(AF_INET, hostname, &server_addr.sin_addr) <= 0) {
-        display_error("ERROR: ", "Invalid hostname/IP address");
-        close(sock);
-        return -1;
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    char report[256];
+    snprintf(report, sizeof(report), "Sent %lu messages (%lu bytes) in %.3f s, %.0f msgs/sec",
+             sent, bytes, secs, secs > 0 ? sent / secs : 0.0);
+    display_message(report);
+    if (skipped > 0) {
+        snprintf(report, sizeof(report), ", skipped %lu lines over %d bytes",
+                 skipped, MAX_LINE_LEN - 2);
+        display_message(report);
     }
+    display_message("\n");
+    return 0;
+}
 
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect");
-        close(sock);
+ssize_t bn_send_msg(char **tokens) {
+    if (tokens[1] != NULL && strcmp(tokens[1], "--close") == 0) {
+        if (tokens[2] != NULL) {
+            display_error("ERROR: ", "Too many arguments");
+            return -1;
+        }
+        close_send_pool();
+        return 0;
+    }
+
+    if (tokens[1] == NULL) {
+        display_error("ERROR: ", "No port provided");
         return -1;
     }
 
+    // A unix:/path target takes the place of both port and hostname
+    const char *host = tokens[1];
+    long port = 0;
+    int first = 2;
+    if (strncmp(tokens[1], UNIX_PREFIX, strlen(UNIX_PREFIX)) != 0) {
+        if (tokens[2] == NULL) {
+            display_error("ERROR: ", "No hostname provided");
+            return -1;
+        }
+        char *endptr;
+        port = strtol(tokens[1], &endptr, 10);
+        if (*endptr != '\0' || port <= 0 || port > 65535) {
+            display_error("ERROR: ", "Invalid port number");
+            return -1;
+        }
+        host = tokens[2];
+        first = 3;
+    }
 
-    fd_set read_fds;
-    char buffer[BUFFER_SIZE];
-    int running = 1;
+    if (tokens[first] == NULL) {
+        display_error("ERROR: ", "No message provided");
+        return -1;
+    }
+    if (strlen(host) >= sizeof(send_pool[0].host)) {
+        display_error("ERROR: ", "Invalid hostname or IP");
+        return -1;
+    }
 
-    while (running) {
-        FD_ZERO(&read_fds);
-        FD_SET(STDIN_FILENO, &read_fds); 
-        FD_SET(sock, &read_fds);          
+    // Stream lines from a file or standard input
+    if (strcmp(tokens[first], "--file") == 0 || strcmp(tokens[first], "-") == 0) {
+        int from_file = tokens[first][1] != '\0';
+        if (from_file && tokens[first + 1] == NULL) {
+            display_error("ERROR: ", "No file provided");
+            return -1;
+        }
+        if (tokens[first + (from_file ? 2 : 1)] != NULL) {
+            display_error("ERROR: ", "Too many arguments");
+            return -1;
+        }
+        int in_fd = STDIN_FILENO;
+        if (from_file) {
+            in_fd = open(tokens[first + 1], O_RDONLY | O_CLOEXEC);
+            if (in_fd < 0) {
+                display_error("ERROR: Could not open file: ", tokens[first + 1]);
+                return -1;
+            }
+        }
+        int ret = send_stream(host, (int)port, in_fd);
+        if (from_file) close(in_fd);
+        return ret;
+    }
 
-        int max_fd = (sock > STDIN_FILENO) ? sock : STDIN_FILENO;
+    char msg_buf[MAX_USER_MSG + 3] = "";
+    for (int i = first; tokens[i] != NULL; i++) {
+        if (strlen(msg_buf) + strlen(tokens[i]) + 2 >= MAX_USER_MSG) {
+            display_error("ERROR: ", "Message too long");
+            return -1;
+        }
+        strcat(msg_buf, tokens[i]);
+        if (tokens[i + 1] != NULL) strcat(msg_buf, " ");
+    }
+    strcat(msg_buf, "\r\n");
 
-        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
-            perror("select");
-            break;
+    // Reuse the open connection to this server; if the server has since
+    // reset it the send fails, so retry once on a fresh one
+    for (int attempt = 0; attempt < 2; attempt++) {
+        SendConn *conn = pooled_connection(host, (int)port);
+        if (!conn) return -1;
+        if (send(conn->fd, msg_buf, strlen(msg_buf), MSG_NOSIGNAL) != -1) {
+            return 0;
         }
+        close(conn->fd);
+        conn->last_used = 0;
+    }
+    display_error("ERROR: ", "Failed to send message");
+    return -1;
+}
 
-        if (FD_ISSET(STDIN_FILENO, &read_fds)) {
-            if (fgets(buffer, BUFFER_SIZE, stdin) == NULL) {
+/* What strip_pings knows about the stream so far: whether the next
+ * byte starts a line, and how much of a ping line it has held back.
+ */
+typedef struct PingFilter {
+    int line_start;
+    size_t held;        // bytes of PING_LINE matched at a line start
+} PingFilter;
 
-                running = 0;
-                break;
+/* Copy what the server sent to shown, cutting out heartbeat ping lines
+ * so they are not shown, including ones split across reads. A partial
+ * ping stays held until the next call shows whether it is one.
+ * Prereq: shown has room for len + strlen(PING_LINE) bytes
+ * Return: the length copied, with *pinged set if there was a ping
+ */
+static size_t strip_pings(PingFilter *filter, const char *data, size_t len,
+                          char *shown, int *pinged) {
+    size_t ping_len = strlen(PING_LINE);
+    size_t shown_len = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (filter->line_start || filter->held > 0) {
+            if (c == PING_LINE[filter->held]) {
+                filter->line_start = 0;
+                if (++filter->held == ping_len) {
+                    filter->held = 0;
+                    filter->line_start = 1;
+                    *pinged = 1;
+                }
+                continue;
             }
+            // Some other line after all; what was held is part of it
+            memcpy(shown + shown_len, PING_LINE, filter->held);
+            shown_len += filter->held;
+            filter->held = 0;
+        }
+        shown[shown_len++] = c;
+        filter->line_start = c == '\n';
+    }
+    return shown_len;
+}
+
+ssize_t start_client(int port, const char *hostname) {
+    if (hostname == NULL || strlen(hostname) == 0) {
+        display_error("ERROR: ", "Invalid hostname");
+        return -1;
+    }
 
+    if (strncmp(hostname, UNIX_PREFIX, strlen(UNIX_PREFIX)) != 0 &&
+        (port <= 0 || port > 65535)) {
+        display_error("ERROR: ", "Invalid port number");
+        return -1;
+    }
 
-            buffer[strcspn(buffer, "\n")] = 0;
+    int sock = connect_to(hostname, port);
+    if (sock < 0) {
+        return -1;
+    }
 
-            if (strcmp(buffer, "\\connected") == 0) {
-                if (send(sock, buffer, strlen(buffer), 0) < 0) {
-                    perror("send");
-                    break;
+    // Replies are read as they come, lines only once the socket takes them
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    char *in = malloc(CLIENT_CHUNK);
+    char *out = malloc(CLIENT_OUT_CAP);
+    char *received = malloc(CLIENT_CHUNK);
+    char *shown = malloc(CLIENT_CHUNK + strlen(PING_LINE));
+    if (!in || !out || !received || !shown) {
+        perror("malloc");
+        free(in);
+        free(out);
+        free(received);
+        free(shown);
+        close(sock);
+        return -1;
+    }
+
+    size_t in_len = 0, out_len = 0;
+    int stdin_open = 1, shut = 0, pong_due = 0;
+    PingFilter pings = {1, 0};
+    while (1) {
+        if (!stdin_open && out_len == 0 && !shut) {
+            // Closing now could reset lines the server hasn't read yet;
+            // half-close instead and let the server hang up once it has
+            shutdown(sock, SHUT_WR);
+            shut = 1;
+        }
+        // Only take more input when a whole chunk of it fits once encoded
+        struct pollfd fds[2];
+        fds[0].fd = (stdin_open && out_len + 2 * CLIENT_CHUNK <= CLIENT_OUT_CAP) ? STDIN_FILENO : -1;
+        fds[0].events = POLLIN;
+        fds[1].fd = sock;
+        fds[1].events = POLLIN | (out_len > 0 ? POLLOUT : 0);
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t bytes = recv(sock, received, CLIENT_CHUNK, 0);
+            if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR)) {
+                if (stdin_open || out_len > 0) {
+                    display_message("\nServer disconnected\n");
                 }
-                continue;
+                break;
             }
-
-            if (send(sock, buffer, strlen(buffer), 0) < 0) {
-                perror("send");
+            size_t shown_len = 0;
+            if (bytes > 0) shown_len = strip_pings(&pings, received, (size_t)bytes, shown, &pong_due);
+            // Everything that arrived goes to the terminal in one write
+            if (shown_len > 0 && write_all(STDOUT_FILENO, shown, shown_len) < 0) {
+                perror("write");
                 break;
             }
         }
 
-        if (FD_ISSET(sock, &read_fds)) {
-            int bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-            if (bytes <= 0) {
-                display_message("\nServer disconnected\n");
-                running = 0;
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(STDIN_FILENO, in + in_len, CLIENT_CHUNK - in_len);
+            if (n < 0 && errno != EINTR) {
+                perror("read");
                 break;
             }
-            buffer[bytes] = '\0';
-            display_message(buffer);
-            display_message("\n");
+            if (n == 0) {
+                stdin_open = 0;
+                // A last line without a newline is still sent
+                if (in_len > 0) in[in_len++] = '\n';
+            }
+            if (n > 0) in_len += (size_t)n;
+
+            // The server splits messages on \r\n
+            size_t start = 0;
+            for (char *nl; (nl = memchr(in + start, '\n', in_len - start)) != NULL; ) {
+                size_t line_len = (size_t)(nl - (in + start));
+                if (line_len > 0 && in[start + line_len - 1] == '\r') line_len--;
+                memcpy(out + out_len, in + start, line_len);
+                memcpy(out + out_len + line_len, "\r\n", 2);
+                out_len += line_len + 2;
+                start = (size_t)(nl - in) + 1;
+            }
+            memmove(in, in + start, in_len - start);
+            in_len -= start;
+            if (in_len >= MAX_LINE_LEN - 2) {
+                // Longer than the server takes; send it in pieces
+                size_t piece = MAX_LINE_LEN - 2;
+                memcpy(out + out_len, in, piece);
+                memcpy(out + out_len + piece, "\r\n", 2);
+                out_len += piece + 2;
+                memmove(in, in + piece, in_len - piece);
+                in_len -= piece;
+            }
+        }
+
+        // The answer waits for room if the server isn't reading our lines
+        if (pong_due && !shut && out_len + strlen(PONG_LINE) <= CLIENT_OUT_CAP) {
+            memcpy(out + out_len, PONG_LINE, strlen(PONG_LINE));
+            out_len += strlen(PONG_LINE);
+            pong_due = 0;
+        }
+
+        // Every line encoded so far goes out in as few sends as the socket allows
+        size_t done = 0;
+        while (done < out_len) {
+            ssize_t n = send(sock, out + done, out_len - done, MSG_NOSIGNAL);
+            if (n < 0) break;
+            done += (size_t)n;
+        }
+        if (done < out_len && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("send");
+            break;
         }
+        memmove(out, out + done, out_len - done);
+        out_len -= done;
     }
 
+    free(in);
+    free(out);
+    free(received);
+    free(shown);
     close(sock);
     return 0;
 }
@@ -1,26 +1,129 @@
 #ifndef _SERVER_H
 #define _SERVER_H
 
+#include <limits.h>
 #include <sys/types.h>
 
+#include "bus.h"
+
 #define BUFFER_SIZE 1024
+#define UNIX_PATH_LEN 108       // sun_path in struct sockaddr_un
+#define UNIX_PREFIX "unix:"     // marks a client target as a socket path
+
+/* What to do with a client whose outbound queue is full.
+ */
+typedef enum SlowPolicy {
+    SLOW_DROP_OLDEST,   // discard the oldest queued message
+    SLOW_DROP_NEWEST,   // discard the message being queued
+    SLOW_DISCONNECT     // drop the client
+} SlowPolicy;
+
+/* Event loop used by the server shards.
+ */
+typedef enum ServerBackend {
+    BACKEND_EPOLL,      // readiness based, works everywhere
+    BACKEND_URING       // completion based io_uring, falls back to epoll
+} ServerBackend;
 
-typedef struct ClientNode {
-    int socket;
-    int id;
-    struct ClientNode *next;
-} ClientNode;
+/* What to do with a client's message once it is over its rate limit.
+ */
+typedef enum ThrottlePolicy {
+    THROTTLE_DELAY,     // stop reading from the client until it has tokens again
+    THROTTLE_DROP       // discard the message
+} ThrottlePolicy;
+
+/* Settings for start_server, filled in from start-server arguments.
+ * Use server_options_default() before overriding individual fields.
+ */
+typedef struct ServerOptions {
+    int workers;        // number of SO_REUSEPORT shards, each on its own thread
+    int pin_cpus;       // pin worker i to cpu i % online cpus
+    int queue_limit;    // max messages queued per client
+    SlowPolicy slow_policy;
+    ServerBackend backend;
+    char log_dir[PATH_MAX]; // persist broadcasts here, empty for no log
+    int log_keep;       // log segments kept, oldest deleted first; 0 keeps all
+    int replay;         // messages replayed from the log to each new client
+    int sndbuf;         // SO_SNDBUF for accepted sockets, 0 for the kernel default
+    int rcvbuf;         // SO_RCVBUF for accepted sockets, 0 for the kernel default
+    int idle_timeout;   // seconds without input before a client is dropped, 0 = never
+    int heartbeat;      // seconds of silence before a ping, 0 = no pings
+    int rate_msgs;      // messages per second each client may send, 0 = unlimited
+    int rate_bytes;     // bytes per second each client may send, 0 = unlimited
+    ThrottlePolicy throttle;
+    int reserve_clients;    // client records and buffers allocated up front
+    int reserve_msgs;       // message buffers of each size class up to 1 KiB allocated up front
+    size_t history;         // bytes of recent broadcasts kept for \search, 0 for none
+    size_t index_mem;       // bytes for their search index, 0 for four times history
+    char unix_path[UNIX_PATH_LEN];  // also listen on this AF_UNIX path, empty for none
+    char federation[BUS_NAME_MAX + 1];  // share broadcasts over this bus, empty for none
+    char ship[UNIX_PATH_LEN];       // ship broadcasts to a standby connecting here, empty for none
+    char standby[UNIX_PATH_LEN];    // follow the primary shipping here and take over its port
+    int echo;           // write every broadcast to stdout
+} ServerOptions;
+
+/* Live counters for a running server, summed over its workers. The
+ * server publishes them in shared memory, so reading them costs no
+ * round-trip to the server process.
+ */
+typedef struct ServerStats {
+    unsigned long clients;          // currently connected
+    unsigned long accepted;         // connections accepted since start
+    unsigned long shed;             // accepted and closed at once for want of fds
+    unsigned long msgs_in;
+    unsigned long bytes_in;
+    unsigned long msgs_out;         // per recipient, once fully written
+    unsigned long bytes_out;
+    unsigned long write_calls;
+    unsigned long queued;           // messages waiting in outbound queues
+    unsigned long dropped_oldest;
+    unsigned long dropped_newest;
+    unsigned long slow_disconnects;
+    unsigned long queue_failures;   // dropped because no outbound queue could be had
+    unsigned long timeouts;         // dropped as idle or for a missed ping
+    unsigned long throttle_delays;  // messages held back by a client's rate limit
+    unsigned long throttle_drops;   // messages discarded by a client's rate limit
+    unsigned long bus_out;          // broadcasts published to the federation bus
+    unsigned long bus_in;           // broadcasts received from other servers
+    unsigned long bus_lost;         // times the bus reader fell behind and skipped ahead
+} ServerStats;
 
-extern ClientNode *clients;
-extern int client_counter;
 extern int server_running;
 
-ssize_t add_client(int client_socket);
-ssize_t remove_client(int client_socket);
+void server_options_default(ServerOptions *opts);
+
+/* Fill opts from option tokens as given to start-server after the
+ * port, ending with NULL.
+ * Return: 0 on success and -1 on error
+ */
+int parse_server_options(char **tokens, ServerOptions *opts);
 ssize_t close_server();
-ssize_t send_message(const char *hostname, int port, const char *message);
+
+/* hostname may instead be UNIX_PREFIX followed by a socket path, and
+ * port is then ignored.
+ */
 ssize_t start_client(int port, const char *hostname);
-ssize_t start_server(int port);
+
+/* port 0 listens on opts->unix_path only.
+ */
+ssize_t start_server(int port, const ServerOptions *opts);
+
+/* Check opts and open what the server needs in this process: its
+ * listeners, log, federation bus and counters.
+ * Return: 0 on success and -1 on error, with nothing left open
+ */
+ssize_t open_server(int port, const ServerOptions *opts);
+
+/* Run the server opened by open_server in this process, as the
+ * standalone server does, until SIGTERM, SIGINT or SIGHUP. Does not
+ * return.
+ */
+void serve();
 ssize_t bn_send_msg(char **tokens);
 
-#endif // SERVER_CLIENT_H
\ No newline at end of file
+/* Return: number of workers, with their counters summed into total and
+ * the seconds since start in *uptime, or -1 if no server is running
+ */
+int server_stats(ServerStats *total, double *uptime);
+
+#endif // SERVER_CLIENT_H
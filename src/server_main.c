@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "io_helpers.h"
+#include "server.h"
+
+/* The chat server on its own, without the shell around it. It takes the
+ * same options as start-server, runs in the foreground by default and
+ * keeps broadcasts off stdout unless asked, since nobody is watching.
+ *
+ * Usage: server <port> [--daemon] [--echo] [start-server options...]
+ */
+
+static void usage() {
+    display_error("Usage: ", "server <port> [--daemon] [--echo] [--workers N] [--log-dir DIR] [--log-keep N]");
+    display_error("       ", "[--backend epoll|io_uring] [--unix PATH] [start-server options...]");
+}
+
+/* Move to the background in a new session, with stdin and stdout on
+ * /dev/null; errors still go to stderr. The parent prints the server's
+ * pid and exits.
+ * Return: 0 in the server and -1 on error
+ */
+static int detach() {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid > 0) {
+        printf("%d\n", (int)pid);
+        exit(EXIT_SUCCESS);
+    }
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        if (null_fd > STDERR_FILENO) close(null_fd);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    char *endptr;
+    long port = strtol(argv[1], &endptr, 10);
+    if (*endptr != '\0' || port < 0 || port > 65535) {
+        display_error("ERROR: Invalid port number ", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    ServerOptions opts;
+    server_options_default(&opts);
+    opts.echo = 0;
+
+    // Take out the options only the standalone server has, pass the rest on
+    int daemonize = 0;
+    char **rest = calloc(argc, sizeof(char *));
+    if (!rest) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    int rest_len = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--daemon") == 0) {
+            daemonize = 1;
+        } else if (strcmp(argv[i], "--help") == 0) {
+            usage();
+            return EXIT_SUCCESS;
+        } else {
+            rest[rest_len++] = argv[i];
+        }
+    }
+    if (parse_server_options(rest, &opts) < 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    free(rest);
+
+    // Listeners and the log are opened first, so their errors reach the caller
+    if (open_server((int)port, &opts) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (daemonize && detach() < 0) {
+        return EXIT_FAILURE;
+    }
+    serve();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "timers.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+
+// ===== Slots =====
+
+static int slot_index(const TimerWheel *wheel, Timer **pprev) {
+    Timer *const *first = &wheel->slots[0][0];
+    if ((Timer *const *)pprev < first || (Timer *const *)pprev >= first + WHEEL_LEVELS * WHEEL_SLOTS) {
+        return -1;
+    }
+    return (int)((Timer *const *)pprev - first);
+}
+
+static void unlink_timer(TimerWheel *wheel, Timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+
+    // Emptied a wheel slot (not a list being fired)
+    int index = slot_index(wheel, timer->pprev);
+    if (index >= 0 && *timer->pprev == NULL) {
+        wheel->occupied[index / WHEEL_SLOTS] &= ~((uint64_t)1 << (index % WHEEL_SLOTS));
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+/* File timer in the slot for its expiry, relative to the current tick.
+ */
+static void insert_timer(TimerWheel *wheel, Timer *timer) {
+    if (timer->expires < wheel->now) timer->expires = wheel->now;
+    uint64_t delta = timer->expires - wheel->now;
+    if (delta >= WHEEL_SPAN) {
+        timer->expires = wheel->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while (delta >> (WHEEL_BITS * (level + 1))) level++;
+    int slot = (int)((timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+    Timer **head = &wheel->slots[level][slot];
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+    wheel->count++;
+}
+
+/* Take a slot's whole list out of the wheel.
+ */
+static void detach_slot(TimerWheel *wheel, int level, int slot, Timer **list) {
+    *list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    if (*list) (*list)->pprev = list;
+}
+
+/* Spread the level's slot for the current tick over the levels below.
+ */
+static void cascade(TimerWheel *wheel, int level) {
+    Timer *list;
+    int slot = (int)((wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    detach_slot(wheel, level, slot, &list);
+    while (list) {
+        Timer *timer = list;
+        unlink_timer(wheel, timer);
+        insert_timer(wheel, timer);
+    }
+}
+
+
+// ===== Wheel =====
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now_ms / TIMER_TICK_MS;
+}
+
+void timer_schedule(TimerWheel *wheel, Timer *timer, uint64_t expires_ms) {
+    if (timer->pprev) unlink_timer(wheel, timer);
+    // Round up so a timer never fires before its time
+    timer->expires = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    insert_timer(wheel, timer);
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if (timer->pprev) unlink_timer(wheel, timer);
+}
+
+/* Return: the next tick at or after the current one with work, or
+ * UINT64_MAX if there is none
+ */
+static uint64_t next_tick(const TimerWheel *wheel) {
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (!wheel->occupied[level]) continue;
+
+        // Level L slots are handled at multiples of 64^L, in slot order
+        int shift = WHEEL_BITS * level;
+        uint64_t base = ((wheel->now + ((uint64_t)1 << shift) - 1) >> shift) << shift;
+        int start = (int)((base >> shift) & WHEEL_MASK);
+        uint64_t bits = wheel->occupied[level];
+        uint64_t rotated = start ? (bits >> start) | (bits << (WHEEL_SLOTS - start)) : bits;
+        uint64_t tick = base + ((uint64_t)__builtin_ctzll(rotated) << shift);
+        if (tick < best) best = tick;
+    }
+    return best;
+}
+
+void timer_advance(TimerWheel *wheel, uint64_t now_ms, TimerFn fn, void *arg) {
+    uint64_t target = now_ms / TIMER_TICK_MS;
+    uint64_t tick;
+    // Jump straight to the ticks with work instead of stepping through all
+    while (wheel->now <= target && (tick = next_tick(wheel)) <= target) {
+        wheel->now = tick;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (tick & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) break;
+            cascade(wheel, level);
+        }
+
+        Timer *list;
+        detach_slot(wheel, 0, (int)(tick & WHEEL_MASK), &list);
+        // Anything scheduled from a callback lands on a later tick
+        wheel->now = tick + 1;
+        while (list) {
+            Timer *timer = list;
+            unlink_timer(wheel, timer);
+            fn(arg, timer);
+        }
+    }
+    if (wheel->now <= target) wheel->now = target + 1;
+}
+
+uint64_t timer_next_ms(const TimerWheel *wheel) {
+    uint64_t tick = next_tick(wheel);
+    return tick == UINT64_MAX ? UINT64_MAX : tick * TIMER_TICK_MS;
+}
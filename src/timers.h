@@ -0,0 +1,57 @@
+#ifndef __TIMERS_H__
+#define __TIMERS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define TIMER_TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5          // 64^5 ticks, about 34 years
+
+/* A timer embedded in whatever it times. pprev is NULL while it is not
+ * scheduled, so cancelling an idle timer is a no-op.
+ */
+typedef struct Timer {
+    uint64_t expires;           // tick it is due
+    struct Timer *next;
+    struct Timer **pprev;
+} Timer;
+
+/* Hierarchical timer wheel: level L holds timers due within 64^(L+1)
+ * ticks in 64 slots of 64^L ticks each, and a slot moves down a level
+ * when the wheel reaches it. Scheduling and cancelling are O(1); each
+ * timer cascades at most WHEEL_LEVELS - 1 times.
+ */
+typedef struct TimerWheel {
+    uint64_t now;               // next tick to process
+    size_t count;
+    uint64_t occupied[WHEEL_LEVELS];    // bit per non-empty slot
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+/* Called for each timer that comes due, after it is unscheduled, so it
+ * may schedule itself again.
+ */
+typedef void (*TimerFn)(void *arg, Timer *timer);
+
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms);
+
+/* (Re)schedule timer for expires_ms, on the same clock as now_ms. It
+ * fires on the first tick at or after that time.
+ */
+void timer_schedule(TimerWheel *wheel, Timer *timer, uint64_t expires_ms);
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+
+/* Fire every timer due by now_ms.
+ */
+void timer_advance(TimerWheel *wheel, uint64_t now_ms, TimerFn fn, void *arg);
+
+/* Return: the time in ms the wheel next has work (a timer due or a slot
+ * to cascade), or UINT64_MAX if no timer is scheduled
+ */
+uint64_t timer_next_ms(const TimerWheel *wheel);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+
+/* A minimal io_uring instance driven through the raw syscalls, so the
+ * server does not need liburing. One ring per server shard.
+ */
+typedef struct Uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;     // sqes handed out but not yet submitted
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+
+/* Return: 1 if this kernel has everything the server backend uses
+ * (multishot accept, provided buffers, sendmsg), 0 otherwise
+ */
+int uring_supported();
+
+/* Return: 0 on success and -1 on error
+ */
+int uring_init(Uring *ring, unsigned entries);
+void uring_exit(Uring *ring);
+
+/* Return: a zeroed sqe to fill in, submitting queued ones first if the
+ * submission queue is full, or NULL on error
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+/* Return: how many sqes can be handed out before a submit is forced
+ */
+unsigned uring_sq_space(Uring *ring);
+
+/* Submit every queued sqe and wait for at least wait_nr completions.
+ * Return: number of sqes submitted or -1 on error
+ */
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr);
+
+/* Return: the next completion or NULL if there is none yet
+ * Prereq: call uring_cqe_seen once done with it
+ */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+
+#endif
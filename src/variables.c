@@ -4,12 +4,15 @@
 
 #include "variables.h"
 #include "io_helpers.h"
+#include "commands.h"
 Var *var_list = NULL;
 int var_count = 0;
 int array_size = 0;
 
 int set_var(char *name, char *value) {
     if (name == NULL || value == NULL) return -1;
+    // Commands found through the old PATH may be elsewhere now
+    if (strcmp(name, "PATH") == 0) command_hash_reset();
 
     // Create the list
     if (var_list == NULL) {